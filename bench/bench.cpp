@@ -0,0 +1,250 @@
+/*
+ * Measures the lookup throughput of CSSTree against std::lower_bound and an Eytzinger layout, for several node sizes,
+ * key types, data sizes and query distributions.
+ *
+ * Usage: bench [max_data_size_in_MB] [n_queries]
+ *
+ * Data sizes grow by a factor of 4 from 16 KB (L1-resident) up to max_data_size_in_MB, which defaults to 10 times the
+ * size of the last-level cache. The output is a tab-separated table with one row per configuration.
+ */
+
+#include "csstree.hpp"
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+#include <string>
+#include <vector>
+#include <algorithm>
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <unistd.h>
+#endif
+
+namespace {
+
+/** A sorted array stored in the order of a breadth-first visit of the implicit binary search tree on its elements. */
+template<typename K>
+class Eytzinger {
+    std::vector<K> b;
+
+    size_t fill(const std::vector<K> &data, size_t i, size_t k) {
+        if (k <= data.size()) {
+            i = fill(data, i, 2 * k);
+            b[k] = data[i++];
+            i = fill(data, i, 2 * k + 1);
+        }
+        return i;
+    }
+
+public:
+
+    explicit Eytzinger(const std::vector<K> &data) : b(data.size() + 1) {
+        fill(data, 0, 1);
+    }
+
+    /**
+     * Returns the first element not less than key, which the descent has just visited. Its position in the sorted
+     * array is not computed, as it would cost one more cache miss per lookup that the layout itself does not have.
+     */
+    const K &lower_bound(K key) const {
+        size_t k = 1;
+        while (k < b.size()) {
+            __builtin_prefetch(b.data() + k * 64 / sizeof(K));
+            k = 2 * k + (b[k] < key);
+        }
+        k >>= __builtin_ffsll(~k);
+        return b[k];
+    }
+};
+
+/** Generates ranks in [0, n) following a Zipfian distribution, as in Gray et al., SIGMOD 1994. */
+class Zipfian {
+    size_t n;
+    double theta, alpha, zetan, eta;
+
+public:
+
+    explicit Zipfian(size_t n, double theta = 0.99) : n(n), theta(theta) {
+        double zeta2 = 1 + std::pow(0.5, theta);
+        zetan = 0;
+        for (size_t i = 1; i <= n; ++i)
+            zetan += 1 / std::pow(double(i), theta);
+        alpha = 1 / (1 - theta);
+        eta = (1 - std::pow(2. / n, 1 - theta)) / (1 - zeta2 / zetan);
+    }
+
+    template<typename G>
+    size_t operator()(G &gen) {
+        double u = std::uniform_real_distribution<double>()(gen);
+        double uz = u * zetan;
+        if (uz < 1)
+            return 0;
+        if (uz < 1 + std::pow(0.5, theta))
+            return 1;
+        return std::min(n - 1, size_t(n * std::pow(eta * u - eta + 1, alpha)));
+    }
+};
+
+enum class Distribution { uniform, zipfian, sequential };
+
+const char *to_string(Distribution d) {
+    return d == Distribution::uniform ? "uniform" : d == Distribution::zipfian ? "zipfian" : "sequential";
+}
+
+template<typename K>
+std::vector<K> make_queries(const std::vector<K> &data, size_t n_queries, Distribution distribution) {
+    std::mt19937_64 gen(42);
+    std::vector<K> queries(n_queries);
+    switch (distribution) {
+        case Distribution::uniform:
+            for (auto &q : queries)
+                q = data[gen() % data.size()];
+            break;
+        case Distribution::zipfian: {
+            // scatter the popular ranks over the whole array, as they are rarely adjacent in practice
+            Zipfian zipf(data.size());
+            for (auto &q : queries)
+                q = data[(zipf(gen) * 0x9E3779B97F4A7C15ull) % data.size()];
+            break;
+        }
+        case Distribution::sequential: {
+            auto start = gen() % data.size();
+            for (size_t i = 0; i < n_queries; ++i)
+                queries[i] = data[(start + i) % data.size()];
+            break;
+        }
+    }
+    return queries;
+}
+
+size_t last_level_cache_size() {
+#if defined(_SC_LEVEL3_CACHE_SIZE)
+    auto size = sysconf(_SC_LEVEL3_CACHE_SIZE);
+    if (size > 0)
+        return size_t(size);
+#endif
+    return size_t(32) << 20;
+}
+
+template<typename F>
+void run(const char *name, const char *key_type, size_t node_size, size_t n, Distribution distribution,
+         size_t n_queries, F f) {
+    auto start = std::chrono::steady_clock::now();
+    auto checksum = f();
+    auto end = std::chrono::steady_clock::now();
+    auto ns = std::chrono::duration<double, std::nano>(end - start).count() / n_queries;
+    std::printf("%s\t%s\t%zu\t%zu\t%s\t%.2f\t%.2f\t%zu\n", name, key_type, node_size, n, to_string(distribution), ns,
+                1000 / ns, checksum % 10);
+    std::fflush(stdout);
+}
+
+template<size_t NodeSize, typename K>
+void bench_csstree(const char *key_type, const std::vector<K> &data, const std::vector<K> &queries,
+                   Distribution distribution) {
+    auto tree = CSSTree<NodeSize, K>::view(data.data(), data.size());
+    run("csstree", key_type, NodeSize, data.size(), distribution, queries.size(), [&] {
+        size_t checksum = 0;
+        for (auto q : queries)
+            checksum += *tree.lower_bound(q);
+        return checksum;
+    });
+
+    auto level_tree = LevelCSSTree<NodeSize, K>::view(data.data(), data.size());
+    run("level_csstree", key_type, NodeSize, data.size(), distribution, queries.size(), [&] {
+        size_t checksum = 0;
+        for (auto q : queries)
+            checksum += *level_tree.lower_bound(q);
+        return checksum;
+    });
+
+    if (NodeSize == 64) {
+        CSSFastTree<K> fast_tree(data);
+        run("fast", key_type, NodeSize, data.size(), distribution, queries.size(), [&] {
+            size_t checksum = 0;
+            for (auto q : queries)
+                checksum += *fast_tree.lower_bound(q);
+            return checksum;
+        });
+
+        // both trees again, with their nodes and elements backed by huge pages
+        CSSTree<NodeSize, K, CSSHugePageAllocator<K>> huge_tree(data);
+        run("csstree_huge", key_type, NodeSize, data.size(), distribution, queries.size(), [&] {
+            size_t checksum = 0;
+            for (auto q : queries)
+                checksum += *huge_tree.lower_bound(q);
+            return checksum;
+        });
+
+        CSSFastTree<K, 2 << 20, CSSHugePageAllocator<K>> huge_fast_tree(data);
+        run("fast_huge", key_type, NodeSize, data.size(), distribution, queries.size(), [&] {
+            size_t checksum = 0;
+            for (auto q : queries)
+                checksum += *huge_fast_tree.lower_bound(q);
+            return checksum;
+        });
+
+        std::vector<typename CSSTree<NodeSize, K>::const_iterator> results(queries.size());
+        run("csstree_batch", key_type, NodeSize, data.size(), distribution, queries.size(), [&] {
+            tree.find_batch(queries.data(), queries.size(), results.begin());
+            size_t checksum = 0;
+            for (auto it : results)
+                checksum += *it;
+            return checksum;
+        });
+    }
+}
+
+template<typename K>
+void bench_key_type(const char *key_type, size_t max_bytes, size_t n_queries) {
+    for (size_t bytes = 16 << 10; bytes <= max_bytes; bytes *= 4) {
+        auto n = bytes / sizeof(K);
+        std::vector<K> data(n);
+        std::mt19937_64 gen(n);
+        std::generate(data.begin(), data.end(), [&] { return K(gen()); });
+        std::sort(data.begin(), data.end());
+        Eytzinger<K> eytzinger(data);
+
+        for (auto distribution : {Distribution::uniform, Distribution::zipfian, Distribution::sequential}) {
+            auto queries = make_queries(data, n_queries, distribution);
+
+            // every structure checksums the element it finds, which is always present as the queries come from data
+            run("std::lower_bound", key_type, 0, n, distribution, n_queries, [&] {
+                size_t checksum = 0;
+                for (auto q : queries)
+                    checksum += *std::lower_bound(data.cbegin(), data.cend(), q);
+                return checksum;
+            });
+
+            run("eytzinger", key_type, 0, n, distribution, n_queries, [&] {
+                size_t checksum = 0;
+                for (auto q : queries)
+                    checksum += eytzinger.lower_bound(q);
+                return checksum;
+            });
+
+            bench_csstree<16>(key_type, data, queries, distribution);
+            bench_csstree<32>(key_type, data, queries, distribution);
+            bench_csstree<64>(key_type, data, queries, distribution);
+            bench_csstree<128>(key_type, data, queries, distribution);
+            bench_csstree<256>(key_type, data, queries, distribution);
+            bench_csstree<512>(key_type, data, queries, distribution);
+            bench_csstree<1024>(key_type, data, queries, distribution);
+            bench_csstree<2048>(key_type, data, queries, distribution);
+            bench_csstree<4096>(key_type, data, queries, distribution);
+        }
+    }
+}
+
+}
+
+int main(int argc, char **argv) {
+    size_t max_bytes = argc > 1 ? size_t(std::atof(argv[1]) * (1 << 20)) : 10 * last_level_cache_size();
+    size_t n_queries = argc > 2 ? size_t(std::atoll(argv[2])) : 1000000;
+
+    std::printf("structure\tkey\tnode_size\tn\tdistribution\tns/lookup\tMlookups/s\tchecksum\n");
+    bench_key_type<uint32_t>("uint32", max_bytes, n_queries);
+    bench_key_type<uint64_t>("uint64", max_bytes, n_queries);
+    return 0;
+}
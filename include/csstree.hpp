@@ -23,127 +23,2833 @@ SOFTWARE.
 #pragma once
 
 #include <vector>
+#include <memory>
+#include <string>
+#include <utility>
+#include <cstddef>
 #include <cstdint>
+#include <cstring>
 #include <cassert>
+#include <istream>
+#include <ostream>
+#include <atomic>
+#include <iterator>
+#include <limits>
+#include <thread>
+#include <exception>
+#include <future>
+#include <mutex>
+#include <chrono>
 #include <algorithm>
 #include <stdexcept>
+#include <type_traits>
+
+#if __cplusplus >= 201703L && defined(__has_include)
+#if __has_include(<memory_resource>)
+#include <memory_resource>
+#define CSSTREE_PMR
+#endif
+#endif
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#define CSSTREE_MMAP
+#endif
+
+/*
+ * With GCC and Clang on x86, the node search is also compiled for the instruction sets not enabled at compile time,
+ * and CSSTree selects at run time the widest one supported by the processor. Define CSSTREE_NO_DISPATCH to use only
+ * the instruction sets enabled at compile time.
+ */
+#if (defined(__clang__) || (defined(__GNUC__) && __GNUC__ >= 5)) && (defined(__x86_64__) || defined(__i386__)) \
+    && !defined(CSSTREE_NO_DISPATCH)
+#include <immintrin.h>
+#define CSSTREE_SIMD
+#define CSSTREE_DISPATCH
+#elif defined(__GNUC__) && (defined(__SSE4_2__) || defined(__AVX2__) || defined(__AVX512F__))
+#include <immintrin.h>
+#define CSSTREE_SIMD
+#endif
+
+#ifdef CSSTREE_SIMD
+#define CSSTREE_SSE42 __attribute__((target("sse4.2,popcnt")))
+#define CSSTREE_AVX2 __attribute__((target("avx2,popcnt")))
+#define CSSTREE_AVX512 __attribute__((target("avx512f,popcnt")))
+#endif
+
+namespace csstree_internal {
+
+/**
+ * Header of the binary format written by CSSTree::save. It is followed by the internal nodes, starting at offset
+ * sizeof(FileHeader), and by the elements, starting at the next multiple of 64 bytes. All the fields and keys are
+ * stored in the byte order of the machine that wrote the file, so a file written with a different endianness fails the
+ * magic number check.
+ */
+struct FileHeader {
+    uint64_t magic;            ///< the string "CSSTREE" followed by a null character
+    uint32_t version;          ///< the version of the format
+    uint32_t layout;           ///< the layout of the internal nodes, 0 for a full CSS-tree and 1 for a level one
+    uint32_t node_size;        ///< the NodeSize parameter of the tree
+    uint32_t order;            ///< the order of the keys, 0 for std::less, 1 for std::greater and 2 for other Compare
+    uint32_t element_size;     ///< the size in bytes of an element
+    uint32_t key_size;         ///< the size in bytes of the key of an element, as stored in the internal nodes
+    uint64_t tree_height;      ///< the height of the tree
+    uint64_t half_marker;      ///< the index of the first leaf node in the deepest level of the tree
+    uint64_t n_internal_nodes; ///< the number of internal nodes
+    uint64_t n_elements;       ///< the number of elements
+};
+
+static_assert(sizeof(FileHeader) == 64, "");
+
+constexpr uint64_t file_magic = 0x0045455254535343; // "CSSTREE\0" read as a little-endian integer
+constexpr uint32_t file_version = 2;
+
+/* Returns the number of bytes left to read from a stream, or the largest size_t if the stream cannot seek. */
+inline size_t remaining_bytes(std::istream &in) {
+    auto position = in.tellg();
+    if (position == std::streampos(-1))
+        return std::numeric_limits<size_t>::max();
+    in.seekg(0, std::ios::end);
+    auto end = in.tellg();
+    in.clear();
+    in.seekg(position);
+    if (end == std::streampos(-1) || end < position)
+        return std::numeric_limits<size_t>::max();
+    return size_t(end - position);
+}
+
+/*
+ * Reads n elements from a stream into v, growing v by at most chunk elements or by its current size at a time, so that
+ * a corrupted n makes the stream end long before the allocations get large. Returns false if the stream ends earlier.
+ */
+template<typename V>
+bool read_growing(std::istream &in, V &v, size_t n, size_t chunk) {
+    using T = typename V::value_type;
+    v.clear();
+    while (v.size() < n) {
+        auto old_size = v.size();
+        v.resize(old_size + std::min(n - old_size, std::max(chunk, old_size)));
+        if (!in.read(reinterpret_cast<char *>(v.data() + old_size), (v.size() - old_size) * sizeof(T)))
+            return false;
+    }
+    return true;
+}
+
+constexpr size_t align_up(size_t x, size_t alignment) {
+    return (x + alignment - 1) / alignment * alignment;
+}
+
+/* Returns the smallest h such that base^h >= x, where power = base^h is the candidate being tested. The recursion stops
+ * before power * base could overflow. */
+constexpr size_t ceil_log(size_t base, size_t x, size_t power = 1) {
+    return power >= x ? 0 : power > x / base ? 1 : 1 + ceil_log(base, x, power * base);
+}
+
+/* Returns base^exponent. */
+constexpr size_t int_pow(size_t base, size_t exponent) {
+    return exponent == 0 ? 1 : base * int_pow(base, exponent - 1);
+}
+
+/* Returns the number of nodes in a complete tree with the given fan-out and number of levels. */
+constexpr size_t subtree_nodes(size_t fanout, size_t levels) {
+    return (int_pow(fanout, levels) - 1) / (fanout - 1);
+}
+
+/* Returns the largest number of levels of a tree that fits in the given number of nodes when its root has two children
+ * and its other nodes have the given fan-out. */
+constexpr size_t page_block_levels(size_t fanout, size_t nodes, size_t levels = 1) {
+    return 1 + 2 * subtree_nodes(fanout, levels) > nodes ? levels : page_block_levels(fanout, nodes, levels + 1);
+}
+
+/* Returns the largest power of two not greater than x, or 0 if x is 0. */
+constexpr size_t floor_pow2(size_t x) {
+    return x < 2 ? x : 2 * floor_pow2(x / 2);
+}
+
+/* Packs the first (at most) 8 bytes of s in a big-endian integer padded with zeros, so that integer order agrees with
+ * the lexicographic order of the strings. */
+inline uint64_t string_prefix(const char *s, size_t length) {
+    uint64_t prefix = 0;
+    for (size_t i = 0; i < 8; ++i)
+        prefix = prefix << 8 | (i < length ? uint8_t(s[i]) : 0);
+    return prefix;
+}
+
+#ifdef CSSTREE_SIMD
+
+/**
+ * Wrappers for the vector instructions used by the node search, for registers of Bytes bytes holding integer lanes
+ * of KeyBytes bytes. Comparisons are signed, unsigned keys are mapped to signed ones by flipping their sign bit.
+ * Each function is compiled for the instruction set of its registers, whether or not it is enabled at compile time.
+ */
+template<size_t Bytes, size_t KeyBytes>
+struct SIMDOps;
+
+#if defined(__SSE4_2__) || defined(CSSTREE_DISPATCH)
+template<>
+struct SIMDOps<16, 4> {
+    using reg = __m128i;
+    CSSTREE_SSE42 static reg set1(uint32_t x) { return _mm_set1_epi32(int32_t(x)); }
+    CSSTREE_SSE42 static reg load(const void *p) { return _mm_loadu_si128((const __m128i *) p); }
+    CSSTREE_SSE42 static reg flip(reg a) { return _mm_xor_si128(a, set1(0x80000000u)); }
+    CSSTREE_SSE42 static unsigned count_gt(reg a, reg b) {
+        return __builtin_popcount(_mm_movemask_ps(_mm_castsi128_ps(_mm_cmpgt_epi32(a, b))));
+    }
+};
+
+template<>
+struct SIMDOps<16, 8> {
+    using reg = __m128i;
+    CSSTREE_SSE42 static reg set1(uint64_t x) { return _mm_set1_epi64x(int64_t(x)); }
+    CSSTREE_SSE42 static reg load(const void *p) { return _mm_loadu_si128((const __m128i *) p); }
+    CSSTREE_SSE42 static reg flip(reg a) { return _mm_xor_si128(a, set1(0x8000000000000000u)); }
+    CSSTREE_SSE42 static unsigned count_gt(reg a, reg b) {
+        return __builtin_popcount(_mm_movemask_pd(_mm_castsi128_pd(_mm_cmpgt_epi64(a, b))));
+    }
+};
+#endif
+
+#if defined(__AVX2__) || defined(CSSTREE_DISPATCH)
+template<>
+struct SIMDOps<32, 4> {
+    using reg = __m256i;
+    CSSTREE_AVX2 static reg set1(uint32_t x) { return _mm256_set1_epi32(int32_t(x)); }
+    CSSTREE_AVX2 static reg load(const void *p) { return _mm256_loadu_si256((const __m256i *) p); }
+    CSSTREE_AVX2 static reg flip(reg a) { return _mm256_xor_si256(a, set1(0x80000000u)); }
+    CSSTREE_AVX2 static unsigned count_gt(reg a, reg b) {
+        return __builtin_popcount(_mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpgt_epi32(a, b))));
+    }
+};
+
+template<>
+struct SIMDOps<32, 8> {
+    using reg = __m256i;
+    CSSTREE_AVX2 static reg set1(uint64_t x) { return _mm256_set1_epi64x(int64_t(x)); }
+    CSSTREE_AVX2 static reg load(const void *p) { return _mm256_loadu_si256((const __m256i *) p); }
+    CSSTREE_AVX2 static reg flip(reg a) { return _mm256_xor_si256(a, set1(0x8000000000000000u)); }
+    CSSTREE_AVX2 static unsigned count_gt(reg a, reg b) {
+        return __builtin_popcount(_mm256_movemask_pd(_mm256_castsi256_pd(_mm256_cmpgt_epi64(a, b))));
+    }
+};
+#endif
+
+#if defined(__AVX512F__) || defined(CSSTREE_DISPATCH)
+template<>
+struct SIMDOps<64, 4> {
+    using reg = __m512i;
+    CSSTREE_AVX512 static reg set1(uint32_t x) { return _mm512_set1_epi32(int32_t(x)); }
+    CSSTREE_AVX512 static reg load(const void *p) { return _mm512_loadu_si512(p); }
+    CSSTREE_AVX512 static reg flip(reg a) { return _mm512_xor_si512(a, set1(0x80000000u)); }
+    CSSTREE_AVX512 static unsigned count_gt(reg a, reg b) {
+        return __builtin_popcount(_mm512_cmpgt_epi32_mask(a, b));
+    }
+};
+
+template<>
+struct SIMDOps<64, 8> {
+    using reg = __m512i;
+    CSSTREE_AVX512 static reg set1(uint64_t x) { return _mm512_set1_epi64(int64_t(x)); }
+    CSSTREE_AVX512 static reg load(const void *p) { return _mm512_loadu_si512(p); }
+    CSSTREE_AVX512 static reg flip(reg a) { return _mm512_xor_si512(a, set1(0x8000000000000000u)); }
+    CSSTREE_AVX512 static unsigned count_gt(reg a, reg b) {
+        return __builtin_popcount(_mm512_cmpgt_epi64_mask(a, b));
+    }
+};
+#endif
+
+/**
+ * Searches a node with the instructions of SIMDOps<Bytes, sizeof(K)>, in a function compiled for their instruction
+ * set, so that it can be called from code compiled without it. Only keys and pointers cross the function boundary.
+ */
+template<size_t Bytes>
+struct SIMDSearch;
+
+#define CSSTREE_SIMD_SEARCH(bytes, target)                                                                             \
+    template<>                                                                                                         \
+    struct SIMDSearch<bytes> {                                                                                         \
+        template<typename K, size_t Slots, bool Upper, bool Descending>                                                \
+        target static size_t search(const K *node, K key) {                                                            \
+            using ops = SIMDOps<bytes, sizeof(K)>;                                                                     \
+            constexpr size_t lanes = bytes / sizeof(K);                                                                \
+            constexpr bool is_unsigned = std::is_unsigned<K>::value;                                                   \
+                                                                                                                       \
+            auto k = ops::set1(key);                                                                                   \
+            if (is_unsigned)                                                                                           \
+                k = ops::flip(k);                                                                                      \
+                                                                                                                       \
+            size_t count = 0;                                                                                          \
+            for (size_t i = 0; i < Slots; i += lanes) {                                                                \
+                auto v = ops::load(node + i);                                                                          \
+                if (is_unsigned)                                                                                       \
+                    v = ops::flip(v);                                                                                  \
+                count += Upper != Descending ? ops::count_gt(v, k) : ops::count_gt(k, v);                              \
+            }                                                                                                          \
+            return Upper ? Slots - count : count;                                                                      \
+        }                                                                                                              \
+    };
+
+#if defined(__SSE4_2__) || defined(CSSTREE_DISPATCH)
+CSSTREE_SIMD_SEARCH(16, CSSTREE_SSE42)
+#endif
+
+#if defined(__AVX2__) || defined(CSSTREE_DISPATCH)
+CSSTREE_SIMD_SEARCH(32, CSSTREE_AVX2)
+#endif
+
+#if defined(__AVX512F__) || defined(CSSTREE_DISPATCH)
+CSSTREE_SIMD_SEARCH(64, CSSTREE_AVX512)
+#endif
+
+#undef CSSTREE_SIMD_SEARCH
+
+#endif
+
+#ifdef CSSTREE_DISPATCH
+
+/**
+ * Returns the width in bytes of the widest vector registers usable by the node search on this processor, or 0 if it
+ * supports none of them. The processor is queried only on the first call. Define CSSTREE_CPU_SIMD_WIDTH to override the
+ * result, e.g. to test the fallback taken on processors without SSE4.2.
+ */
+inline size_t cpu_simd_width() {
+#ifdef CSSTREE_CPU_SIMD_WIDTH
+    return CSSTREE_CPU_SIMD_WIDTH;
+#else
+    static const size_t width = [] {
+        __builtin_cpu_init();
+        if (!__builtin_cpu_supports("popcnt"))
+            return size_t(0);
+        if (__builtin_cpu_supports("avx512f"))
+            return size_t(64);
+        if (__builtin_cpu_supports("avx2"))
+            return size_t(32);
+        return size_t(__builtin_cpu_supports("sse4.2") ? 16 : 0);
+    }();
+    return width;
+#endif
+}
+
+#endif
+
+/**
+ * Calls f(begin, end) on the ranges of a partition of [0, n), using up to n_threads threads (or one per hardware thread
+ * if n_threads is 0). Ranges are not split below a minimum size, so small inputs are processed in the calling thread.
+ */
+template<typename F>
+void parallel_for(size_t n, size_t n_threads, F f) {
+    constexpr size_t min_chunk_size = 1 << 14;
+    if (n_threads == 0)
+        n_threads = std::max(1u, std::thread::hardware_concurrency());
+    n_threads = std::min(n_threads, std::max<size_t>(1, n / min_chunk_size));
+    if (n_threads == 1) {
+        f(size_t(0), n);
+        return;
+    }
+
+    // an exception thrown by f in a worker is stored, and the first one is rethrown once all threads have joined
+    auto chunk_size = (n + n_threads - 1) / n_threads;
+    std::vector<std::exception_ptr> errors(n_threads);
+    auto run = [&](size_t t) {
+        try {
+            f(std::min(n, t * chunk_size), std::min(n, (t + 1) * chunk_size));
+        } catch (...) {
+            errors[t] = std::current_exception();
+        }
+    };
+
+    std::vector<std::thread> threads;
+    threads.reserve(n_threads - 1);
+    try {
+        for (size_t t = 1; t < n_threads; ++t)
+            threads.emplace_back(run, t);
+    } catch (...) {
+        for (auto &thread : threads)
+            thread.join();
+        throw;
+    }
+    run(0);
+    for (auto &thread : threads)
+        thread.join();
+    for (auto &error : errors)
+        if (error)
+            std::rethrow_exception(error);
+}
+
+/* Hints the processor to bring the cache line containing p into the cache. */
+inline void prefetch(const void *p) {
+#ifdef __GNUC__
+    __builtin_prefetch(p);
+#else
+    (void) p;
+#endif
+}
+
+/**
+ * Returns the width in bytes of the widest vector register that evenly divides a node of the given size, or 0 if no
+ * suitable instruction set is enabled at compile time. The instruction sets compiled only for run-time dispatch do not
+ * count, since code that is not dispatched cannot assume the processor supports them.
+ */
+#if defined(CSSTREE_SIMD) && defined(__AVX512F__)
+constexpr size_t simd_width(size_t node_bytes) {
+    return node_bytes % 64 == 0 ? 64 : node_bytes % 32 == 0 ? 32 : node_bytes % 16 == 0 ? 16 : 0;
+}
+#elif defined(CSSTREE_SIMD) && defined(__AVX2__)
+constexpr size_t simd_width(size_t node_bytes) {
+    return node_bytes % 32 == 0 ? 32 : node_bytes % 16 == 0 ? 16 : 0;
+}
+#elif defined(CSSTREE_SIMD) && defined(__SSE4_2__)
+constexpr size_t simd_width(size_t node_bytes) {
+    return node_bytes % 16 == 0 ? 16 : 0;
+}
+#else
+constexpr size_t simd_width(size_t) {
+    return 0;
+}
+#endif
+
+/* Returns the largest width among width, width / 2, ..., 16 that evenly divides a node of the given size, or 0. */
+constexpr size_t fit_simd_width(size_t node_bytes, size_t width) {
+    return width < 16 ? 0 : node_bytes % width == 0 ? width : fit_simd_width(node_bytes, width / 2);
+}
+
+/**
+ * Counts the keys in a node of N keys that satisfy a predicate, with the loop fully unrolled at compile time. Since the
+ * keys of a node are sorted, the count of keys preceding the searched one is the index of the child to visit next.
+ */
+template<size_t N>
+struct Unrolled {
+    template<typename T, typename K, typename Predicate>
+    static inline size_t count(const T *node, K key, Predicate p) {
+        return Unrolled<N / 2>::count(node, key, p) + Unrolled<N - N / 2>::count(node + N / 2, key, p);
+    }
+};
+
+template<>
+struct Unrolled<1> {
+    template<typename T, typename K, typename Predicate>
+    static inline size_t count(const T *node, K key, Predicate p) {
+        return p(node[0], key);
+    }
+};
+
+/**
+ * Searches a node of Slots sorted keys of type K by comparing all of them against the key at once.
+ * @tparam Vectorized true if the node can be searched with vector instructions, i.e. if K is a 32- or 64-bit integer
+ *                    and the size of the node is a multiple of the width of an available vector register
+ */
+template<typename K, size_t Slots,
+    bool Vectorized = std::is_integral<K>::value && (sizeof(K) == 4 || sizeof(K) == 8)
+        && simd_width(Slots * sizeof(K)) != 0>
+struct NodeSearch {
+    static constexpr bool vectorized = false;
+};
+
+#ifdef CSSTREE_SIMD
+template<typename K, size_t Slots>
+struct NodeSearch<K, Slots, true> {
+    static constexpr bool vectorized = true;
+
+    /**
+     * Returns the number of keys in the node that are less than key (Upper = false) or not greater than key
+     * (Upper = true), i.e. the index of the child to visit next. If Descending is true, the node is sorted in
+     * decreasing order and the roles of less and greater are swapped.
+     */
+    template<bool Upper, bool Descending>
+    static inline size_t search(const K *node, K key) {
+        return SIMDSearch<simd_width(Slots * sizeof(K))>::template search<K, Slots, Upper, Descending>(node, key);
+    }
+};
+#endif
+
+/**
+ * An allocator adaptor that returns memory aligned to Alignment bytes, obtained by over-allocating from Base.
+ * @tparam T the type of the elements to allocate
+ * @tparam Alignment the alignment in bytes, a power of two not smaller than the size of a pointer
+ * @tparam Base the allocator providing the memory
+ */
+template<typename T, size_t Alignment, typename Base>
+class AlignedAllocator {
+    static_assert(Alignment >= sizeof(void *) && (Alignment & (Alignment - 1)) == 0, "");
+
+    using byte_allocator = typename std::allocator_traits<Base>::template rebind_alloc<char>;
+
+    template<typename, size_t, typename> friend class AlignedAllocator;
+
+    byte_allocator base;
+
+    /* Returns the number of bytes requested from base for n elements, with room for the padding and the pointer. */
+    static size_t allocation_size(size_t n) {
+        return n * sizeof(T) + Alignment + sizeof(void *);
+    }
+
+public:
+
+    using value_type = T;
+
+    template<typename U>
+    struct rebind {
+        using other = AlignedAllocator<U, Alignment, Base>;
+    };
+
+    AlignedAllocator() = default;
+
+    explicit AlignedAllocator(const Base &base) : base(base) {}
+
+    template<typename U>
+    AlignedAllocator(const AlignedAllocator<U, Alignment, Base> &other) : base(other.base) {}
+
+    T *allocate(size_t n) {
+        // the address returned by base, which may have any alignment, is stored right before the aligned block
+        auto raw = &*std::allocator_traits<byte_allocator>::allocate(base, allocation_size(n));
+        auto address = reinterpret_cast<uintptr_t>(raw);
+        auto aligned = raw + (align_up(address + sizeof(raw), Alignment) - address);
+        std::memcpy(aligned - sizeof(raw), &raw, sizeof(raw));
+        return reinterpret_cast<T *>(aligned);
+    }
+
+    void deallocate(T *p, size_t n) {
+        char *raw;
+        std::memcpy(&raw, reinterpret_cast<char *>(p) - sizeof(raw), sizeof(raw));
+        std::allocator_traits<byte_allocator>::deallocate(base, raw, allocation_size(n));
+    }
+
+    /* Copies of a container use the allocator that Base selects for copies, as the containers using Base do. */
+    AlignedAllocator select_on_container_copy_construction() const {
+        using traits = std::allocator_traits<byte_allocator>;
+        return AlignedAllocator(Base(traits::select_on_container_copy_construction(base)));
+    }
+
+    using propagate_on_container_copy_assignment =
+        typename std::allocator_traits<Base>::propagate_on_container_copy_assignment;
+    using propagate_on_container_move_assignment =
+        typename std::allocator_traits<Base>::propagate_on_container_move_assignment;
+    using propagate_on_container_swap = typename std::allocator_traits<Base>::propagate_on_container_swap;
+
+    template<typename U>
+    bool operator==(const AlignedAllocator<U, Alignment, Base> &other) const {
+        return base == other.base;
+    }
+
+    template<typename U>
+    bool operator!=(const AlignedAllocator<U, Alignment, Base> &other) const {
+        return !(*this == other);
+    }
+};
+
+}
+
+/**
+ * An allocator that backs allocations of at least 2 MB with transparent huge pages, so that a large tree is covered by
+ * few TLB entries. Such allocations are mapped at a 2 MB boundary with mmap and marked with madvise(MADV_HUGEPAGE).
+ * Smaller allocations, and all allocations on systems without transparent huge pages, are served by std::allocator.
+ * @tparam T the type of the elements to allocate
+ */
+template<typename T>
+class CSSHugePageAllocator {
+    static constexpr size_t huge_page_size = size_t(2) << 20;
+
+public:
+
+    using value_type = T;
+
+    CSSHugePageAllocator() = default;
+
+    template<typename U>
+    CSSHugePageAllocator(const CSSHugePageAllocator<U> &) {}
+
+    T *allocate(size_t n) {
+#if defined(CSSTREE_MMAP) && defined(MADV_HUGEPAGE)
+        auto bytes = n * sizeof(T);
+        if (bytes >= huge_page_size) {
+            auto size = csstree_internal::align_up(bytes, huge_page_size);
+            auto p = ::mmap(nullptr, size + huge_page_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+            if (p == MAP_FAILED)
+                throw std::bad_alloc();
+
+            // unmap the excess before and after the aligned region
+            auto begin = reinterpret_cast<uintptr_t>(p);
+            auto aligned = csstree_internal::align_up(begin, huge_page_size);
+            if (aligned != begin)
+                ::munmap(p, aligned - begin);
+            if (aligned + size != begin + size + huge_page_size)
+                ::munmap(reinterpret_cast<void *>(aligned + size), begin + huge_page_size - aligned);
+            ::madvise(reinterpret_cast<void *>(aligned), size, MADV_HUGEPAGE);
+            return reinterpret_cast<T *>(aligned);
+        }
+#endif
+        return std::allocator<T>().allocate(n);
+    }
+
+    void deallocate(T *p, size_t n) {
+#if defined(CSSTREE_MMAP) && defined(MADV_HUGEPAGE)
+        auto bytes = n * sizeof(T);
+        if (bytes >= huge_page_size) {
+            ::munmap(p, csstree_internal::align_up(bytes, huge_page_size));
+            return;
+        }
+#endif
+        std::allocator<T>().deallocate(p, n);
+    }
+
+    template<typename U>
+    bool operator==(const CSSHugePageAllocator<U> &) const {
+        return true;
+    }
+
+    template<typename U>
+    bool operator!=(const CSSHugePageAllocator<U> &) const {
+        return false;
+    }
+};
+
+template<typename T>
+constexpr size_t CSSHugePageAllocator<T>::huge_page_size;
+
+/**
+ * Layout of a full CSS-tree, whose nodes hold as many keys as fit in NodeSize bytes and are searched by a linear scan
+ * (or a binary search for nodes larger than 256 bytes).
+ */
+struct CSSFullLayout {};
+
+/**
+ * Layout of a level CSS-tree, whose nodes hold 2^t - 1 keys, where 2^t keys is the largest power of two that fits in
+ * NodeSize bytes. The node is searched by a perfectly balanced binary search that takes exactly t comparisons, at the
+ * cost of a lower fan-out (the last slot of a node is unused).
+ */
+struct CSSLevelLayout {};
+
+/**
+ * The default projection of CSSTree, which uses the elements themselves as keys.
+ */
+struct CSSIdentity {
+    template<typename T>
+    const T &operator()(const T &x) const {
+        return x;
+    }
+};
+
+/**
+ * A projection that maps a float or a double to an unsigned integer of the same size, such that the integer order is a
+ * total order on the floating-point values: -inf < ... < -0.0 = +0.0 < ... < +inf < NaN. All NaNs are mapped to the
+ * same integer, and so are the two zeros.
+ * @tparam F the floating-point type, float or double
+ */
+template<typename F>
+struct CSSFloatKey {
+    static_assert(std::is_floating_point<F>::value && (sizeof(F) == 4 || sizeof(F) == 8), "");
+
+    using bits_type = typename std::conditional<sizeof(F) == 4, uint32_t, uint64_t>::type;
+
+    bits_type operator()(F x) const {
+        constexpr auto sign = bits_type(1) << (sizeof(F) * 8 - 1);
+        if (x != x)
+            return ~bits_type(0);
+        if (x == 0)
+            return sign;
+        bits_type bits;
+        std::memcpy(&bits, &x, sizeof(bits));
+        return bits & sign ? ~bits : bits | sign;
+    }
+};
+
+/**
+ * A static (read-only) multiway tree stored implicitly, without pointers.
+ *
+ * The elements may contain runs of equivalent keys, even spanning several leaf nodes. Each search descends the tree
+ * once, so find, count and equal_range take time logarithmic in the number of elements regardless of the run length,
+ * and find always returns the first element of the run.
+ *
+ * The implementation is derived from the paper:
+ * Rao, J., & Ross, K. A. (1998). Cache conscious indexing for decision-support in main memory.
+ *
+ * @tparam NodeSize the size in bytes of a node
+ * @tparam K the type of the elements in the container
+ * @tparam Allocator the allocator of the internal nodes and of the elements owned by the container, e.g.
+ *                   CSSHugePageAllocator<K> to back large trees with huge pages. The nodes are in any case aligned to a
+ *                   cache line, or to a 4 KB page if their size is a multiple of it
+ * @tparam Layout the layout of the nodes, either CSSFullLayout or CSSLevelLayout
+ * @tparam Compare the strict weak ordering of the keys, a default-constructible function object type; the elements must
+ *                 be sorted by it. Node searches use vector instructions only with std::less and std::greater
+ * @tparam Projection a default-constructible function object type that maps an element to its key, e.g. a field of a
+ *                    struct. Internal nodes store the projected keys, and lookups take a key rather than an element
+ */
+template<size_t NodeSize, typename K = int64_t, typename Allocator = std::allocator<K>, typename Layout = CSSFullLayout,
+    typename Compare = std::less<K>, typename Projection = CSSIdentity>
+class CSSTree {
+public:
+
+    using key_type = typename std::decay<decltype(std::declval<const Projection &>()(std::declval<const K &>()))>::type;
+    using value_type = K;
+    using key_compare = Compare;
+
+private:
+
+    static_assert(NodeSize >= sizeof(key_type), "");
+    static_assert(std::is_same<Layout, CSSFullLayout>::value || std::is_same<Layout, CSSLevelLayout>::value, "");
+
+    static constexpr bool level = std::is_same<Layout, CSSLevelLayout>::value;
+    static_assert(!level || NodeSize >= 2 * sizeof(key_type),
+                  "A level CSS-tree needs room for at least two keys per node");
+
+    /* Whether the elements are the keys themselves, so that leaf nodes can be searched like internal nodes. */
+    static constexpr bool identity = std::is_same<Projection, CSSIdentity>::value;
+
+    /* The number of slots in the memory of a node. */
+    static constexpr size_t node_stride = level
+                                          ? csstree_internal::floor_pow2(NodeSize / sizeof(key_type))
+                                          : NodeSize / sizeof(key_type);
+
+    /* The number of keys in a node (and of elements in a leaf node). */
+    static constexpr size_t slots_per_node = level ? node_stride - 1 : node_stride;
+
+    static constexpr size_t node_alignment = node_stride * sizeof(key_type) % 4096 == 0 ? 4096 : 64;
+
+    using node_allocator = csstree_internal::AlignedAllocator<key_type, node_alignment, Allocator>;
+
+    static constexpr bool ascending = std::is_same<Compare, std::less<key_type>>::value;
+    static constexpr bool descending = std::is_same<Compare, std::greater<key_type>>::value;
+
+    struct unrolled_search {};
+    struct vectorized_search {};
+    struct binary_search {};
+    struct balanced_search {};
+
+    using node_search = typename std::conditional<level, balanced_search,
+        typename std::conditional<(NodeSize > 256), binary_search,
+            typename std::conditional<csstree_internal::NodeSearch<key_type, slots_per_node>::vectorized
+                                      && (ascending || descending),
+                vectorized_search, unrolled_search>::type>::type>::type;
+
+    /* A vectorized search with registers of Bytes bytes, whose instruction set is selected at run time. */
+    template<size_t Bytes>
+    struct dispatched_search {};
+
+    static constexpr size_t node_bytes = slots_per_node * sizeof(key_type);
+
+    /*
+     * Whether the node search may use registers wider than the ones enabled at compile time, if the processor supports
+     * them. In that case lower_bound, upper_bound and the batch searches call, through a function pointer, a copy of
+     * the search compiled for the widest instruction set available, which is selected on their first call.
+     */
+#ifdef CSSTREE_DISPATCH
+    static constexpr bool dispatched = !level && NodeSize <= 256 && (ascending || descending)
+        && std::is_integral<key_type>::value && (sizeof(key_type) == 4 || sizeof(key_type) == 8)
+        && csstree_internal::fit_simd_width(node_bytes, 64) > csstree_internal::simd_width(node_bytes);
+#else
+    static constexpr bool dispatched = false;
+#endif
+
+    size_t tree_height;
+    size_t half_marker;
+    size_t n_internal_nodes;
+    size_t n_elements;
+    std::vector<key_type, node_allocator> tree_storage; ///< the internal nodes, if owned by the container
+    const key_type *tree;                               ///< the internal nodes, in tree_storage or in a mapped file
+    std::vector<K, Allocator> leaves_storage;           ///< the elements, if owned by the container
+    const K *leaves;                                    ///< the elements, in leaves_storage or in a caller's buffer
+    std::shared_ptr<const void> mapping;                ///< the mapped file the container refers to, if any
+
+public:
+
+    using const_iterator = const K *;
+
+private:
+
+    /*
+     * Returns true if the subtree whose largest element is sep lies entirely before the position searched by a
+     * lower_bound (Upper = false) or an upper_bound (Upper = true) of key.
+     */
+    template<bool Upper>
+    static inline bool precedes(key_type sep, key_type key) {
+        return Upper ? !Compare()(key, sep) : Compare()(sep, key);
+    }
+
+    /* Returns true if the key of the given element precedes the bound of key, as in precedes. */
+    template<bool Upper>
+    static inline bool element_precedes(const K &element, key_type key) {
+        return precedes<Upper>(Projection()(element), key);
+    }
+
+    /* Returns the number of the slots_per_node sorted keys at node that precede the bound of key. */
+    template<bool Upper, typename Search = node_search>
+    static inline size_t search_node(const key_type *node, key_type key) {
+        return search_node<Upper>(node, key, Search());
+    }
+
+    template<bool Upper>
+    static inline size_t search_node(const key_type *node, key_type key, unrolled_search) {
+        return csstree_internal::Unrolled<slots_per_node>::count(node, key, precedes<Upper>);
+    }
+
+    template<bool Upper>
+    static inline size_t search_node(const key_type *node, key_type key, vectorized_search) {
+        return csstree_internal::NodeSearch<key_type, slots_per_node>::template search<Upper, descending>(node, key);
+    }
+
+#ifdef CSSTREE_DISPATCH
+    template<bool Upper, size_t Bytes>
+    static inline size_t search_node(const key_type *node, key_type key, dispatched_search<Bytes>) {
+        using simd_search = csstree_internal::SIMDSearch<Bytes>;
+        return simd_search::template search<key_type, slots_per_node, Upper, descending>(node, key);
+    }
+#endif
+
+    template<bool Upper>
+    static inline size_t search_node(const key_type *node, key_type key, binary_search) {
+        auto end = node + slots_per_node;
+        auto it = Upper ? std::upper_bound(node, end, key, Compare()) : std::lower_bound(node, end, key, Compare());
+        return it - node;
+    }
+
+    template<bool Upper>
+    static inline size_t search_node(const key_type *node, key_type key, balanced_search) {
+        size_t count = 0;
+        for (auto step = node_stride / 2; step > 0; step /= 2)
+            count += precedes<Upper>(node[count + step - 1], key) ? step : 0;
+        return count;
+    }
+
+    /*
+     * Returns the bound of key in the sorted range [lo, hi), which holds at most slots_per_node elements. A full leaf
+     * node of keys is searched like an internal node; the last, partially filled one, and the leaves of projected
+     * elements, are searched by counting the elements preceding key with no early exit, which avoids mispredictions and
+     * never reads past hi.
+     */
+    template<bool Upper, typename Search = node_search>
+    inline const_iterator bound_in_leaves(const_iterator lo, const_iterator hi, key_type key) const {
+        return bound_in_leaves<Upper, Search>(lo, hi, key, std::integral_constant<bool, identity>());
+    }
+
+    template<bool Upper, typename Search>
+    inline const_iterator bound_in_leaves(const_iterator lo, const_iterator hi, key_type key, std::true_type) const {
+        if (size_t(hi - lo) == slots_per_node)
+            return lo + search_node<Upper, Search>(lo, key);
+        return bound_in_leaves<Upper, Search>(lo, hi, key, std::false_type());
+    }
+
+    template<bool Upper, typename Search>
+    inline const_iterator bound_in_leaves(const_iterator lo, const_iterator hi, key_type key, std::false_type) const {
+        if (NodeSize > 256) {
+            auto key_less = [](key_type k, const K &e) { return Compare()(k, Projection()(e)); };
+            auto element_less = [](const K &e, key_type k) { return Compare()(Projection()(e), k); };
+            return Upper ? std::upper_bound(lo, hi, key, key_less) : std::lower_bound(lo, hi, key, element_less);
+        }
+
+        size_t count = 0;
+        for (auto it = lo; it != hi; ++it)
+            count += element_precedes<Upper>(*it, key);
+        return lo + count;
+    }
+
+    /* Returns the index of the child of the given internal node to visit when searching for key. */
+    template<bool Upper, typename Search = node_search>
+    inline size_t next_child(size_t node, key_type key) const {
+        return node * (slots_per_node + 1) + 1 + search_node<Upper, Search>(tree + node * node_stride, key);
+    }
+
+    /* Returns the offset in leaves of the first element of the given leaf node. */
+    inline size_t leaf_offset(size_t child) const {
+        long diff = (long(child) - long(half_marker)) * slots_per_node;
+        if (diff < 0)
+            diff += n_elements;
+        assert(diff >= 0);
+        return std::min(n_elements, size_t(diff));
+    }
+
+    template<bool Upper, typename Search = node_search>
+    inline const_iterator bound_in_leaf_node(size_t child, key_type key) const {
+        auto offset = leaf_offset(child);
+        auto lo = leaves + offset;
+        auto hi = leaves + std::min(n_elements, offset + slots_per_node);
+        return bound_in_leaves<Upper, Search>(lo, hi, key);
+    }
+
+    template<bool Upper, typename Search = node_search>
+    inline const_iterator bound(key_type key) const {
+        if (n_internal_nodes == 0)
+            return bound_in_leaves<Upper, Search>(begin(), end(), key);
+
+        size_t child = 0;
+        while (child < n_internal_nodes)
+            child = next_child<Upper, Search>(child, key);
+        return bound_in_leaf_node<Upper, Search>(child, key);
+    }
+
+    /* The number of keys whose searches descend the tree together in a batch. */
+    static constexpr size_t batch_group = 16;
+
+    /*
+     * Stores in results the bounds of the m <= batch_group given keys. The searches descend the tree one level at a
+     * time, so that the nodes needed by the next level are prefetched for the whole group.
+     */
+    template<bool Upper, typename Search = node_search>
+    inline void bound_group(const key_type *keys, size_t m, const_iterator *results) const {
+        if (n_internal_nodes == 0) {
+            for (size_t j = 0; j < m; ++j)
+                results[j] = bound_in_leaves<Upper, Search>(begin(), end(), keys[j]);
+            return;
+        }
+
+        size_t children[batch_group] = {};
+        for (size_t level = 0; level < tree_height; ++level) {
+            for (size_t j = 0; j < m; ++j) {
+                if (children[j] >= n_internal_nodes)
+                    continue;
+                auto child = next_child<Upper, Search>(children[j], keys[j]);
+                if (child < n_internal_nodes)
+                    prefetch_range(tree + child * node_stride, node_stride);
+                else {
+                    auto offset = leaf_offset(child);
+                    prefetch_range(leaves + offset, std::min(slots_per_node, n_elements - offset));
+                }
+                children[j] = child;
+            }
+        }
+
+        for (size_t j = 0; j < m; ++j)
+            results[j] = bound_in_leaf_node<Upper, Search>(children[j], keys[j]);
+    }
+
+    template<bool Upper>
+    inline const_iterator dispatched_bound(key_type key) const {
+        return dispatched_bound<Upper>(key, std::integral_constant<bool, dispatched>());
+    }
+
+    template<bool Upper>
+    inline const_iterator dispatched_bound(key_type key, std::false_type) const {
+        return bound<Upper>(key);
+    }
+
+    template<bool Upper>
+    inline void dispatched_bound_group(const key_type *keys, size_t m, const_iterator *results) const {
+        dispatched_bound_group<Upper>(keys, m, results, std::integral_constant<bool, dispatched>());
+    }
+
+    template<bool Upper>
+    inline void dispatched_bound_group(const key_type *keys, size_t m, const_iterator *results, std::false_type) const {
+        bound_group<Upper>(keys, m, results);
+    }
+
+#ifdef CSSTREE_DISPATCH
+    using bound_function = const_iterator (*)(const CSSTree &, key_type);
+    using bound_group_function = void (*)(const CSSTree &, const key_type *, size_t, const_iterator *);
+
+    template<bool Upper>
+    inline const_iterator dispatched_bound(key_type key, std::true_type) const {
+        static const bound_function f = select_copy(bound_default<Upper>, bound_sse42<Upper>, bound_avx2<Upper>,
+                                                    bound_avx512<Upper>);
+        return f(*this, key);
+    }
+
+    template<bool Upper>
+    inline void dispatched_bound_group(const key_type *keys, size_t m, const_iterator *results, std::true_type) const {
+        static const bound_group_function f = select_copy(bound_group_default<Upper>, bound_group_sse42<Upper>,
+                                                          bound_group_avx2<Upper>, bound_group_avx512<Upper>);
+        f(*this, keys, m, results);
+    }
+
+    /* Returns the copy of a search compiled for the widest instruction set supported by the processor. */
+    template<typename Function>
+    static Function select_copy(Function default_copy, Function sse42, Function avx2, Function avx512) {
+        auto width = csstree_internal::fit_simd_width(node_bytes, csstree_internal::cpu_simd_width());
+        if (width <= csstree_internal::simd_width(node_bytes))
+            return default_copy;
+        return width == 64 ? avx512 : width == 32 ? avx2 : sse42;
+    }
+
+    template<bool Upper>
+    static const_iterator bound_default(const CSSTree &tree, key_type key) {
+        return tree.bound<Upper>(key);
+    }
+
+    template<bool Upper>
+    CSSTREE_SSE42 __attribute__((flatten)) static const_iterator bound_sse42(const CSSTree &tree, key_type key) {
+        return tree.bound<Upper, dispatched_search<csstree_internal::fit_simd_width(node_bytes, 16)>>(key);
+    }
+
+    template<bool Upper>
+    CSSTREE_AVX2 __attribute__((flatten)) static const_iterator bound_avx2(const CSSTree &tree, key_type key) {
+        return tree.bound<Upper, dispatched_search<csstree_internal::fit_simd_width(node_bytes, 32)>>(key);
+    }
+
+    template<bool Upper>
+    CSSTREE_AVX512 __attribute__((flatten)) static const_iterator bound_avx512(const CSSTree &tree, key_type key) {
+        return tree.bound<Upper, dispatched_search<csstree_internal::fit_simd_width(node_bytes, 64)>>(key);
+    }
+
+    template<bool Upper>
+    static void bound_group_default(const CSSTree &tree, const key_type *keys, size_t m, const_iterator *results) {
+        tree.bound_group<Upper>(keys, m, results);
+    }
+
+    template<bool Upper>
+    CSSTREE_SSE42 __attribute__((flatten))
+    static void bound_group_sse42(const CSSTree &tree, const key_type *keys, size_t m, const_iterator *results) {
+        using search = dispatched_search<csstree_internal::fit_simd_width(node_bytes, 16)>;
+        tree.bound_group<Upper, search>(keys, m, results);
+    }
+
+    template<bool Upper>
+    CSSTREE_AVX2 __attribute__((flatten))
+    static void bound_group_avx2(const CSSTree &tree, const key_type *keys, size_t m, const_iterator *results) {
+        using search = dispatched_search<csstree_internal::fit_simd_width(node_bytes, 32)>;
+        tree.bound_group<Upper, search>(keys, m, results);
+    }
+
+    template<bool Upper>
+    CSSTREE_AVX512 __attribute__((flatten))
+    static void bound_group_avx512(const CSSTree &tree, const key_type *keys, size_t m, const_iterator *results) {
+        using search = dispatched_search<csstree_internal::fit_simd_width(node_bytes, 64)>;
+        tree.bound_group<Upper, search>(keys, m, results);
+    }
+#endif
+
+    /* Calls f(i, it) with the result it of the search of each keys[i], searching them in groups of batch_group keys. */
+    template<bool Upper, typename F>
+    void bound_batch(const key_type *keys, size_t n, F f) const {
+        const_iterator results[batch_group];
+        for (size_t first = 0; first < n; first += batch_group) {
+            auto m = n - first < batch_group ? n - first : batch_group;
+            dispatched_bound_group<Upper>(keys + first, m, results);
+            for (size_t j = 0; j < m; ++j)
+                f(first + j, results[j]);
+        }
+    }
+
+    template<typename T>
+    static inline void prefetch_range(const T *p, size_t count) {
+        auto begin = reinterpret_cast<const char *>(p);
+        auto end = reinterpret_cast<const char *>(p + count);
+        for (; begin < end; begin += 64)
+            csstree_internal::prefetch(begin);
+    }
+
+    bool owns_leaves() const {
+        return leaves == leaves_storage.data();
+    }
+
+    bool owns_tree() const {
+        return tree == tree_storage.data();
+    }
+
+    /* Leaves the container empty, without releasing the elements it refers to. */
+    void clear() {
+        tree_height = 0;
+        half_marker = 0;
+        n_internal_nodes = 0;
+        n_elements = 0;
+        tree_storage.clear();
+        tree = nullptr;
+        leaves_storage.clear();
+        leaves = nullptr;
+        mapping.reset();
+    }
+
+    /* Computes the shape of a tree over n_elements elements, with exact integer arithmetic. */
+    void compute_shape() {
+        const auto leaf_nodes = std::max<size_t>(1, (n_elements + slots_per_node - 1) / slots_per_node);
+        tree_height = csstree_internal::ceil_log(slots_per_node + 1, leaf_nodes);
+        const auto expp = csstree_internal::int_pow(slots_per_node + 1, tree_height);
+        const auto last_internal_node = (expp - leaf_nodes) / slots_per_node;
+        n_internal_nodes = (expp - 1) / slots_per_node - last_internal_node;
+        half_marker = (expp - 1) / slots_per_node;
+    }
+
+    /* Computes the shape of the tree and fills the internal nodes from the elements in leaves. */
+    void build(size_t n_threads) {
+        compute_shape();
+        tree_storage.assign(n_internal_nodes * node_stride, key_type());
+        tree = tree_storage.data();
+        csstree_internal::parallel_for(n_internal_nodes * slots_per_node, n_threads, [this](size_t begin, size_t end) {
+            fill(begin, end);
+        });
+    }
+
+    /* Fills the keys of the internal nodes in the range [begin, end) of the keys in level order. */
+    void fill(size_t begin, size_t end) {
+        const auto n = n_elements;
+        const auto last_internal_node = half_marker - n_internal_nodes;
+        size_t i = end;
+        while (i-- > begin) {
+            auto node = i / slots_per_node;
+            auto child = node * (slots_per_node + 1) + 1 + i % slots_per_node;
+            while (child < n_internal_nodes) // follow rightmost branch
+                child = child * (slots_per_node + 1) + slots_per_node + 1;
+
+            // child is a leaf -> map it to an index in the tree
+            auto &slot = tree_storage[node * node_stride + i % slots_per_node];
+            long diff = (child - half_marker) * slots_per_node;
+            if (diff < 0)
+                slot = Projection()(leaves[diff + n + slots_per_node - 1]);
+            else if (diff + slots_per_node - 1 < n - last_internal_node * slots_per_node)
+                slot = Projection()(leaves[diff + slots_per_node - 1]);
+            else
+                // special case: fill ancestor of the last leaf node with the
+                // last element of (the biggest in) the first half of the tree
+                slot = Projection()(leaves[n - last_internal_node * slots_per_node - 1]);
+        }
+    }
+
+    static bool is_sorted(const K *data, size_t n, size_t n_threads) {
+        std::atomic<bool> sorted(true);
+        csstree_internal::parallel_for(n, n_threads, [&](size_t begin, size_t end) {
+            auto less = [](const K &a, const K &b) { return Compare()(Projection()(a), Projection()(b)); };
+            if (!std::is_sorted(data + begin, data + std::min(n, end + 1), less))
+                sorted = false;
+        });
+        return sorted;
+    }
+
+    explicit CSSTree(const Allocator &alloc)
+        : tree_height(0),
+          half_marker(0),
+          n_internal_nodes(0),
+          n_elements(0),
+          tree_storage(node_allocator(alloc)),
+          tree(nullptr),
+          leaves_storage(alloc),
+          leaves(nullptr) {}
+
+    /*
+     * The order of the keys recorded in a saved file. Trees with different Compare types of order 2 are not told
+     * apart.
+     */
+    static constexpr uint32_t file_order = ascending ? 0 : descending ? 1 : 2;
+
+    /* Returns the offset in a saved file of the first element. */
+    size_t file_leaves_offset() const {
+        return csstree_internal::align_up(sizeof(csstree_internal::FileHeader) + size_in_bytes(), 64);
+    }
+
+    /*
+     * Sets the shape of the tree from the header of a saved file, checking that it matches this type of tree and that
+     * it has at most max_elements elements.
+     */
+    void read_header(const csstree_internal::FileHeader &header, size_t max_elements) {
+        if (header.magic != csstree_internal::file_magic || header.version != csstree_internal::file_version)
+            throw std::runtime_error("Not a CSSTree file or unsupported format version");
+        if (header.layout != (level ? 1 : 0) || header.node_size != NodeSize || header.order != file_order
+            || header.element_size != sizeof(K) || header.key_size != sizeof(key_type))
+            throw std::runtime_error("The file was saved from a CSSTree of a different type");
+
+        if (header.n_elements > max_elements)
+            throw std::runtime_error("Corrupted CSSTree file");
+        n_elements = size_t(header.n_elements);
+        compute_shape();
+        if (header.tree_height != tree_height || header.half_marker != half_marker
+            || header.n_internal_nodes != n_internal_nodes)
+            throw std::runtime_error("Corrupted CSSTree file");
+    }
+
+public:
+
+    /**
+     * Constructs the container with the copy of the contents of data, which must be sorted.
+     * @param data the vector to be used as source to initialize the elements of the container with
+     * @param n_threads the number of threads used to check the data and build the tree, 0 to use all the hardware
+     *                  threads
+     * @param alloc the allocator of the internal nodes and of the copy of data
+     */
+    explicit CSSTree(const std::vector<K> &data, size_t n_threads = 1, const Allocator &alloc = Allocator())
+        : n_elements(data.size()),
+          tree_storage(node_allocator(alloc)),
+          leaves_storage(data.begin(), data.end(), alloc),
+          leaves(leaves_storage.data()) {
+        if (!is_sorted(data.data(), data.size(), n_threads))
+            throw std::invalid_argument("Data must be sorted");
+        build(n_threads);
+    }
+
+    /**
+     * Constructs the container with the contents of data, which must be sorted, using move semantics. If data is not
+     * sorted, it is left untouched.
+     * @param data the vector to be moved into the container
+     * @param n_threads the number of threads used to check the data and build the tree, 0 to use all the hardware
+     *                  threads
+     */
+    explicit CSSTree(std::vector<K, Allocator> &&data, size_t n_threads = 1)
+        : n_elements(data.size()),
+          tree_storage(node_allocator(data.get_allocator())),
+          leaves_storage(data.get_allocator()) {
+        if (!is_sorted(data.data(), data.size(), n_threads))
+            throw std::invalid_argument("Data must be sorted");
+        leaves_storage = std::move(data);
+        leaves = leaves_storage.data();
+        build(n_threads);
+    }
+
+    /**
+     * Returns a container over the n sorted elements pointed to by data, without copying them. The container only
+     * allocates its internal nodes, and the caller must keep the elements alive and unmodified for as long as the
+     * container (or any copy of it) is in use.
+     * @param data pointer to the first of the elements, which must be sorted
+     * @param n the number of elements
+     * @param n_threads the number of threads used to check the data and build the tree, 0 to use all the hardware
+     *                  threads
+     * @param alloc the allocator of the internal nodes
+     * @return the container
+     */
+    static CSSTree view(const K *data, size_t n, size_t n_threads = 1, const Allocator &alloc = Allocator()) {
+        if (!is_sorted(data, n, n_threads))
+            throw std::invalid_argument("Data must be sorted");
+        CSSTree result(alloc);
+        result.n_elements = n;
+        result.leaves = data;
+        result.build(n_threads);
+        return result;
+    }
+
+    /**
+     * Constructs a container with the elements of tree, plus those in inserted, minus those in erased, with a single
+     * linear merge of the three sorted sequences. The internal nodes are then filled from the merged elements, without
+     * sorting them or checking that they are sorted.
+     *
+     * Each element of erased removes one element of tree equivalent to it, if any. Inserted elements are placed after
+     * the elements of tree equivalent to them.
+     * @param tree the container whose elements are updated
+     * @param inserted the sorted elements to insert
+     * @param erased the sorted elements to remove
+     * @param n_threads the number of threads used to check the updates and build the tree, 0 to use all the hardware
+     *                  threads
+     * @return the container with the updated elements, which uses the allocator of tree
+     */
+    static CSSTree merge(const CSSTree &tree, const std::vector<K> &inserted,
+                         const std::vector<K> &erased = std::vector<K>(), size_t n_threads = 1) {
+        if (!is_sorted(inserted.data(), inserted.size(), n_threads) || !is_sorted(erased.data(), erased.size(), 1))
+            throw std::invalid_argument("Data must be sorted");
+
+        auto less = [](const K &a, const K &b) { return Compare()(Projection()(a), Projection()(b)); };
+        CSSTree result(tree.leaves_storage.get_allocator());
+        auto &merged = result.leaves_storage;
+        merged.reserve(tree.size() + inserted.size());
+
+        auto in = inserted.begin();
+        auto out = erased.begin();
+        for (auto it = tree.begin(); it != tree.end(); ++it) {
+            while (out != erased.end() && less(*out, *it))
+                ++out;
+            if (out != erased.end() && !less(*it, *out)) {
+                ++out;
+                continue;
+            }
+            for (; in != inserted.end() && less(*in, *it); ++in)
+                merged.push_back(*in);
+            merged.push_back(*it);
+        }
+        merged.insert(merged.end(), in, inserted.end());
+
+        result.n_elements = merged.size();
+        result.leaves = merged.data();
+        result.build(n_threads);
+        return result;
+    }
+
+    CSSTree(const CSSTree &other)
+        : tree_height(other.tree_height),
+          half_marker(other.half_marker),
+          n_internal_nodes(other.n_internal_nodes),
+          n_elements(other.n_elements),
+          tree_storage(other.tree_storage),
+          tree(other.owns_tree() ? tree_storage.data() : other.tree),
+          leaves_storage(other.leaves_storage),
+          leaves(other.owns_leaves() ? leaves_storage.data() : other.leaves),
+          mapping(other.mapping) {}
+
+    CSSTree &operator=(const CSSTree &other) {
+        if (this != &other) {
+            tree_height = other.tree_height;
+            half_marker = other.half_marker;
+            n_internal_nodes = other.n_internal_nodes;
+            n_elements = other.n_elements;
+            tree_storage = other.tree_storage;
+            tree = other.owns_tree() ? tree_storage.data() : other.tree;
+            leaves_storage = other.leaves_storage;
+            leaves = other.owns_leaves() ? leaves_storage.data() : other.leaves;
+            mapping = other.mapping;
+        }
+        return *this;
+    }
+
+    /**
+     * Constructs the container with the contents of other using move semantics. After the move, other is empty.
+     * @param other the container to be moved
+     */
+    CSSTree(CSSTree &&other) noexcept
+        : tree_height(other.tree_height),
+          half_marker(other.half_marker),
+          n_internal_nodes(other.n_internal_nodes),
+          n_elements(other.n_elements),
+          tree_storage(std::move(other.tree_storage)),
+          tree(other.tree),
+          leaves_storage(std::move(other.leaves_storage)),
+          leaves(other.leaves),
+          mapping(std::move(other.mapping)) {
+        other.clear();
+    }
+
+    /**
+     * Replaces the contents of the container with those of other using move semantics. After the move, other is empty.
+     * @param other the container to be moved
+     * @return *this
+     */
+    CSSTree &operator=(CSSTree &&other)
+        noexcept(std::allocator_traits<Allocator>::propagate_on_container_move_assignment::value) {
+        if (this != &other) {
+            auto owning_tree = other.owns_tree();
+            auto owning_leaves = other.owns_leaves();
+            tree_height = other.tree_height;
+            half_marker = other.half_marker;
+            n_internal_nodes = other.n_internal_nodes;
+            n_elements = other.n_elements;
+            tree_storage = std::move(other.tree_storage);
+            tree = owning_tree ? tree_storage.data() : other.tree;
+            leaves_storage = std::move(other.leaves_storage);
+            leaves = owning_leaves ? leaves_storage.data() : other.leaves;
+            mapping = std::move(other.mapping);
+            other.clear();
+        }
+        return *this;
+    }
+
+    /**
+     * Finds the first element with key equivalent to key.
+     * @param key key value of the element to search for
+     * @return an iterator to the first element with key equivalent to key. If no such element is found, past-the-end
+     *         iterator is returned
+     */
+    inline const_iterator find(key_type key) const {
+        auto it = lower_bound(key);
+        return it != end() && !Compare()(key, Projection()(*it)) ? it : end();
+    }
+
+    /**
+     * Returns the number of elements with key equivalent to key.
+     * @param key key value of the elements to count
+     * @return the number of elements with key equivalent to key
+     */
+    inline size_t count(key_type key) const {
+        return upper_bound(key) - lower_bound(key);
+    }
+
+    /**
+     * Returns an iterator pointing to the first element that is not less than key.
+     * @param key key value to compare the elements to
+     * @return an iterator to the first element that is not less than key, or past-the-end iterator if no such
+     *         element is found
+     */
+    inline const_iterator lower_bound(key_type key) const {
+        return dispatched_bound<false>(key);
+    }
+
+    /**
+     * Returns an iterator pointing to the first element that is greater than key.
+     * @param key key value to compare the elements to
+     * @return an iterator to the first element that is greater than key, or past-the-end iterator if no such
+     *         element is found
+     */
+    inline const_iterator upper_bound(key_type key) const {
+        return dispatched_bound<true>(key);
+    }
+
+    /**
+     * Returns a range containing all elements with key equivalent to key.
+     * @param key key value to compare the elements to
+     * @return a pair of iterators defining the range, as returned by lower_bound and upper_bound
+     */
+    inline std::pair<const_iterator, const_iterator> equal_range(key_type key) const {
+        return {lower_bound(key), upper_bound(key)};
+    }
+
+    /**
+     * Finds the first element with key equivalent to each of the given keys.
+     *
+     * This is faster than calling find on each key, as the searches are interleaved so that the memory accesses of one
+     * search overlap with the computation of the others.
+     * @param keys pointer to the first of the keys to search for
+     * @param n the number of keys to search for
+     * @param out the beginning of the destination range, which receives n iterators as returned by find
+     * @return an output iterator to the element past the last element written
+     */
+    template<typename OutputIt>
+    OutputIt find_batch(const key_type *keys, size_t n, OutputIt out) const {
+        bound_batch<false>(keys, n, [&](size_t i, const_iterator it) {
+            *out++ = it != end() && !Compare()(keys[i], Projection()(*it)) ? it : end();
+        });
+        return out;
+    }
+
+    /**
+     * Returns the number of elements whose key is less than key, i.e. the position where key would be inserted.
+     * @param key key value to compare the elements to
+     * @return the position of the first element that is not less than key, or size() if no such element is found
+     */
+    inline size_t rank(key_type key) const {
+        return lower_bound(key) - begin();
+    }
+
+    /**
+     * Returns the position of the first element with key equivalent to key.
+     * @param key key value of the element to search for
+     * @return the position of the first element with key equivalent to key, or size() if no such element is found
+     */
+    inline size_t position_of(key_type key) const {
+        return find(key) - begin();
+    }
+
+    /**
+     * Returns the range of positions of the elements with key equivalent to key.
+     * @param key key value to compare the elements to
+     * @return the pair of positions [first, last) of the elements with key equivalent to key, as in equal_range
+     */
+    inline std::pair<size_t, size_t> position_range(key_type key) const {
+        return {rank(key), size_t(upper_bound(key) - begin())};
+    }
+
+    /**
+     * Returns the element at the given position.
+     * @param i the position of the element, smaller than size()
+     * @return a reference to the i-th smallest element
+     */
+    const K &select(size_t i) const {
+        assert(i < n_elements);
+        return leaves[i];
+    }
+
+    /**
+     * Computes the rank of each of the given keys, searching them as in find_batch.
+     * @param keys pointer to the first of the keys to search for
+     * @param n the number of keys to search for
+     * @param out the beginning of the destination range, which receives n positions as returned by rank
+     * @return an output iterator to the element past the last element written
+     */
+    template<typename OutputIt>
+    OutputIt rank_batch(const key_type *keys, size_t n, OutputIt out) const {
+        bound_batch<false>(keys, n, [&](size_t, const_iterator it) {
+            *out++ = size_t(it - begin());
+        });
+        return out;
+    }
+
+    /**
+     * Finds the position of the first element with key equivalent to each of the given keys, as in find_batch.
+     * @param keys pointer to the first of the keys to search for
+     * @param n the number of keys to search for
+     * @param out the beginning of the destination range, which receives n positions as returned by position_of
+     * @return an output iterator to the element past the last element written
+     */
+    template<typename OutputIt>
+    OutputIt position_of_batch(const key_type *keys, size_t n, OutputIt out) const {
+        bound_batch<false>(keys, n, [&](size_t i, const_iterator it) {
+            *out++ = it != end() && !Compare()(keys[i], Projection()(*it)) ? size_t(it - begin()) : n_elements;
+        });
+        return out;
+    }
+
+    /**
+     * Returns an iterator to the first element of the container; that is, the first leaf element.
+     * @return an iterator to the first element
+     */
+    const_iterator begin() const {
+        return leaves;
+    }
+
+    /**
+     * Returns an iterator to the element following the last element of the container.
+     * @return an iterator to the element following the last element
+     */
+    const_iterator end() const {
+        return leaves + n_elements;
+    }
+
+    /**
+     * Writes the container to a stream, in a binary format that can be read back with load or memory-mapped with map.
+     * @param out the stream to write to, which should be opened in binary mode
+     */
+    void save(std::ostream &out) const {
+        static_assert(std::is_trivially_copyable<K>::value && std::is_trivially_copyable<key_type>::value,
+                      "Only trivially copyable keys can be saved");
+
+        csstree_internal::FileHeader header;
+        header.magic = csstree_internal::file_magic;
+        header.version = csstree_internal::file_version;
+        header.layout = level ? 1 : 0;
+        header.node_size = NodeSize;
+        header.order = file_order;
+        header.element_size = sizeof(K);
+        header.key_size = sizeof(key_type);
+        header.tree_height = tree_height;
+        header.half_marker = half_marker;
+        header.n_internal_nodes = n_internal_nodes;
+        header.n_elements = n_elements;
+
+        const char padding[64] = {};
+        auto tree_end = sizeof(header) + size_in_bytes();
+        out.write(reinterpret_cast<const char *>(&header), sizeof(header));
+        out.write(reinterpret_cast<const char *>(tree), size_in_bytes());
+        out.write(padding, file_leaves_offset() - tree_end);
+        out.write(reinterpret_cast<const char *>(leaves), n_elements * sizeof(K));
+        if (!out)
+            throw std::runtime_error("Could not write the CSSTree");
+    }
+
+    /**
+     * Reads a container written by save from a stream, copying its contents in memory.
+     * @param in the stream to read from, which should be opened in binary mode
+     * @param alloc the allocator of the internal nodes and of the elements
+     * @return the container
+     */
+    static CSSTree load(std::istream &in, const Allocator &alloc = Allocator()) {
+        static_assert(std::is_trivially_copyable<K>::value && std::is_trivially_copyable<key_type>::value,
+                      "Only trivially copyable keys can be loaded");
+
+        CSSTree result(alloc);
+        csstree_internal::FileHeader header;
+        if (!in.read(reinterpret_cast<char *>(&header), sizeof(header)))
+            throw std::runtime_error("Not a CSSTree file or unsupported format version");
+        result.read_header(header, result.leaves_storage.max_size());
+
+        // the sizes in the header are checked against the stream before allocating, or read 1 MB at a time if unknown
+        auto file_bytes = result.file_leaves_offset() - sizeof(header) + result.n_elements * sizeof(K);
+        auto stream_bytes = csstree_internal::remaining_bytes(in);
+        if (stream_bytes < file_bytes)
+            throw std::runtime_error("Truncated CSSTree file");
+        auto known = stream_bytes != std::numeric_limits<size_t>::max();
+        auto tree_chunk = known ? result.n_internal_nodes * node_stride : (size_t(1) << 20) / sizeof(key_type) + 1;
+        auto leaves_chunk = known ? result.n_elements : (size_t(1) << 20) / sizeof(K) + 1;
+
+        char padding[64];
+        if (!csstree_internal::read_growing(in, result.tree_storage, result.n_internal_nodes * node_stride, tree_chunk)
+            || !in.read(padding, result.file_leaves_offset() - sizeof(header) - result.size_in_bytes())
+            || !csstree_internal::read_growing(in, result.leaves_storage, result.n_elements, leaves_chunk))
+            throw std::runtime_error("Truncated CSSTree file");
+
+        result.tree = result.tree_storage.data();
+        result.leaves = result.leaves_storage.data();
+        return result;
+    }
+
+#ifdef CSSTREE_MMAP
+
+    /**
+     * Memory-maps a file written by save and returns a container that serves lookups directly from the mapping, without
+     * reading or copying its contents. The file is unmapped when the container and all its copies are destroyed.
+     * @param path the path of the file
+     * @return the container
+     */
+    static CSSTree map(const std::string &path) {
+        static_assert(std::is_trivially_copyable<K>::value && std::is_trivially_copyable<key_type>::value,
+                      "Only trivially copyable keys can be mapped");
+
+        auto fd = ::open(path.c_str(), O_RDONLY);
+        if (fd < 0)
+            throw std::runtime_error("Could not open " + path);
+
+        struct stat st;
+        if (::fstat(fd, &st) != 0 || size_t(st.st_size) < sizeof(csstree_internal::FileHeader)) {
+            ::close(fd);
+            throw std::runtime_error("Not a CSSTree file or unsupported format version");
+        }
+
+        auto size = size_t(st.st_size);
+        auto address = ::mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0);
+        ::close(fd);
+        if (address == MAP_FAILED)
+            throw std::runtime_error("Could not map " + path);
+
+        CSSTree result((Allocator()));
+        result.mapping = std::shared_ptr<const void>(address, [size](const void *p) {
+            ::munmap(const_cast<void *>(p), size);
+        });
+
+        csstree_internal::FileHeader header;
+        std::memcpy(&header, address, sizeof(header));
+        result.read_header(header, (size - sizeof(header)) / sizeof(K));
+        if (size < result.file_leaves_offset() + result.n_elements * sizeof(K))
+            throw std::runtime_error("Truncated CSSTree file");
+
+        auto bytes = static_cast<const char *>(address);
+        result.tree = reinterpret_cast<const key_type *>(bytes + sizeof(header));
+        result.leaves = reinterpret_cast<const K *>(bytes + result.file_leaves_offset());
+        return result;
+    }
+
+#endif
+
+    /**
+     * Returns the size in bytes of all the internal nodes in the tree.
+     * @return the size in bytes of the internal nodes
+     */
+    size_t size_in_bytes() const {
+        return n_internal_nodes * node_stride * sizeof(key_type);
+    }
+
+    /**
+     * Returns the height of the tree.
+     * @return the height of the tree
+     */
+    size_t height() const {
+        return tree_height;
+    }
+
+    /**
+     * Returns the number of elements in the container.
+     * @return the number of elements in the container
+     */
+    size_t size() const {
+        return n_elements;
+    }
+
+};
+
+template<size_t NodeSize, typename K, typename Allocator, typename Layout, typename Compare, typename Projection>
+constexpr bool CSSTree<NodeSize, K, Allocator, Layout, Compare, Projection>::level;
+
+template<size_t NodeSize, typename K, typename Allocator, typename Layout, typename Compare, typename Projection>
+constexpr bool CSSTree<NodeSize, K, Allocator, Layout, Compare, Projection>::identity;
+
+template<size_t NodeSize, typename K, typename Allocator, typename Layout, typename Compare, typename Projection>
+constexpr size_t CSSTree<NodeSize, K, Allocator, Layout, Compare, Projection>::node_stride;
+
+template<size_t NodeSize, typename K, typename Allocator, typename Layout, typename Compare, typename Projection>
+constexpr size_t CSSTree<NodeSize, K, Allocator, Layout, Compare, Projection>::slots_per_node;
+
+template<size_t NodeSize, typename K, typename Allocator, typename Layout, typename Compare, typename Projection>
+constexpr size_t CSSTree<NodeSize, K, Allocator, Layout, Compare, Projection>::node_alignment;
+
+template<size_t NodeSize, typename K, typename Allocator, typename Layout, typename Compare, typename Projection>
+constexpr bool CSSTree<NodeSize, K, Allocator, Layout, Compare, Projection>::ascending;
+
+template<size_t NodeSize, typename K, typename Allocator, typename Layout, typename Compare, typename Projection>
+constexpr bool CSSTree<NodeSize, K, Allocator, Layout, Compare, Projection>::descending;
+
+/**
+ * A level CSS-tree, i.e. a CSSTree whose nodes hold 2^t - 1 keys searched with exactly t comparisons.
+ */
+template<size_t NodeSize, typename K = int64_t, typename Allocator = std::allocator<K>>
+using LevelCSSTree = CSSTree<NodeSize, K, Allocator, CSSLevelLayout>;
+
+#ifdef CSSTREE_PMR
+
+/**
+ * A CSSTree whose memory is obtained from a std::pmr::memory_resource, passed to the constructors as the allocator.
+ */
+template<size_t NodeSize, typename K = int64_t>
+using CSSPmrTree = CSSTree<NodeSize, K, std::pmr::polymorphic_allocator<K>>;
+
+#endif
+
+/**
+ * A static (read-only) associative container mapping sorted keys to values, indexed by a CSSTree.
+ *
+ * Keys and values are stored in two separate arrays, so that the nodes and the leaves searched by the tree contain only
+ * keys, and a value is accessed only once its key has been found.
+ *
+ * @tparam NodeSize the size in bytes of a node
+ * @tparam K the type of the keys
+ * @tparam V the type of the values
+ */
+template<size_t NodeSize, typename K = int64_t, typename V = uint64_t>
+class CSSMap {
+    CSSTree<NodeSize, K> tree;
+    std::vector<V> values;
+
+public:
+
+    /** An iterator over the key-value pairs of the container, in key order. */
+    class const_iterator {
+        const K *k;
+        const V *v;
+
+        friend class CSSMap;
+
+        const_iterator(const K *k, const V *v) : k(k), v(v) {}
+
+    public:
+
+        using iterator_category = std::random_access_iterator_tag;
+        using value_type = std::pair<K, V>;
+        using difference_type = std::ptrdiff_t;
+        using reference = std::pair<const K &, const V &>;
+
+        /* The result of operator->, which holds the pair of references to the key and the value. */
+        struct pointer {
+            reference pair;
+            const reference *operator->() const { return &pair; }
+        };
+
+        const_iterator() : k(nullptr), v(nullptr) {}
+
+        const K &key() const { return *k; }
+
+        const V &value() const { return *v; }
+
+        reference operator*() const { return reference(*k, *v); }
+
+        pointer operator->() const { return pointer{reference(*k, *v)}; }
+
+        reference operator[](difference_type n) const { return reference(k[n], v[n]); }
+
+        const_iterator &operator++() { ++k, ++v; return *this; }
+
+        const_iterator &operator--() { --k, --v; return *this; }
+
+        const_iterator operator++(int) { auto it = *this; ++*this; return it; }
+
+        const_iterator operator--(int) { auto it = *this; --*this; return it; }
+
+        const_iterator &operator+=(difference_type n) { k += n, v += n; return *this; }
+
+        const_iterator &operator-=(difference_type n) { k -= n, v -= n; return *this; }
+
+        const_iterator operator+(difference_type n) const { return const_iterator(k + n, v + n); }
+
+        friend const_iterator operator+(difference_type n, const const_iterator &it) { return it + n; }
+
+        const_iterator operator-(difference_type n) const { return const_iterator(k - n, v - n); }
+
+        difference_type operator-(const const_iterator &other) const { return k - other.k; }
+
+        bool operator==(const const_iterator &other) const { return k == other.k; }
+
+        bool operator!=(const const_iterator &other) const { return k != other.k; }
+
+        bool operator<(const const_iterator &other) const { return k < other.k; }
+
+        bool operator>(const const_iterator &other) const { return k > other.k; }
+
+        bool operator<=(const const_iterator &other) const { return k <= other.k; }
+
+        bool operator>=(const const_iterator &other) const { return k >= other.k; }
+    };
+
+private:
+
+    const_iterator to_iterator(typename CSSTree<NodeSize, K>::const_iterator it) const {
+        return const_iterator(it, values.data() + (it - tree.begin()));
+    }
+
+public:
+
+    /**
+     * Constructs the container with the given keys, which must be sorted, and the corresponding values.
+     * @param keys the keys of the container
+     * @param values the values of the container, values[i] being the value associated with keys[i]
+     * @param n_threads the number of threads used to check the keys and build the tree, 0 to use all the hardware
+     *                  threads
+     */
+    CSSMap(std::vector<K> keys, std::vector<V> values, size_t n_threads = 1)
+        : tree(std::move(keys), n_threads), values(std::move(values)) {
+        if (tree.size() != this->values.size())
+            throw std::invalid_argument("Keys and values must have the same size");
+    }
+
+    /**
+     * Finds the first key-value pair with key equivalent to key.
+     * @param key key value of the element to search for
+     * @return an iterator to the first key-value pair with key equivalent to key. If no such pair is found,
+     *         past-the-end iterator is returned
+     */
+    const_iterator find(K key) const {
+        return to_iterator(tree.find(key));
+    }
+
+    /**
+     * Returns the number of key-value pairs with key equivalent to key.
+     * @param key key value of the pairs to count
+     * @return the number of pairs with key equivalent to key
+     */
+    size_t count(K key) const {
+        return tree.count(key);
+    }
+
+    /**
+     * Returns a pointer to the value associated with key, or with its first occurrence if the key is repeated.
+     * @param key key value of the element to search for
+     * @return a pointer to the value associated with key, or nullptr if no such key is found
+     */
+    const V *get(K key) const {
+        auto it = tree.find(key);
+        return it == tree.end() ? nullptr : values.data() + (it - tree.begin());
+    }
+
+    /**
+     * Returns an iterator pointing to the first key-value pair whose key is not less than key.
+     * @param key key value to compare the keys to
+     * @return an iterator to the first pair whose key is not less than key, or past-the-end iterator if no such pair
+     *         is found
+     */
+    const_iterator lower_bound(K key) const {
+        return to_iterator(tree.lower_bound(key));
+    }
+
+    /**
+     * Returns an iterator pointing to the first key-value pair whose key is greater than key.
+     * @param key key value to compare the keys to
+     * @return an iterator to the first pair whose key is greater than key, or past-the-end iterator if no such pair is
+     *         found
+     */
+    const_iterator upper_bound(K key) const {
+        return to_iterator(tree.upper_bound(key));
+    }
+
+    /**
+     * Returns a range containing all key-value pairs with key equivalent to key.
+     * @param key key value to compare the keys to
+     * @return a pair of iterators defining the range, as returned by lower_bound and upper_bound
+     */
+    std::pair<const_iterator, const_iterator> equal_range(K key) const {
+        return {lower_bound(key), upper_bound(key)};
+    }
+
+    /**
+     * Returns an iterator to the first key-value pair of the container.
+     * @return an iterator to the first pair
+     */
+    const_iterator begin() const {
+        return to_iterator(tree.begin());
+    }
+
+    /**
+     * Returns an iterator to the key-value pair following the last one of the container.
+     * @return an iterator to the pair following the last one
+     */
+    const_iterator end() const {
+        return to_iterator(tree.end());
+    }
+
+    /**
+     * Returns the size in bytes of all the internal nodes in the tree.
+     * @return the size in bytes of the internal nodes
+     */
+    size_t size_in_bytes() const {
+        return tree.size_in_bytes();
+    }
+
+    /**
+     * Returns the height of the tree.
+     * @return the height of the tree
+     */
+    size_t height() const {
+        return tree.height();
+    }
+
+    /**
+     * Returns the number of key-value pairs in the container.
+     * @return the number of key-value pairs in the container
+     */
+    size_t size() const {
+        return tree.size();
+    }
+
+};
+
+/**
+ * A static (read-only) container of sorted strings, indexed by a CSSTree on fixed-width prefixes of the strings.
+ *
+ * The internal nodes and the leaves searched by the tree hold, for each string, the 8 bytes that follow the longest
+ * prefix common to all the strings, packed in a big-endian integer. A lookup descends the tree on integers only, and
+ * compares full strings just to resolve the (usually short) run of strings sharing the prefix of the key.
+ *
+ * @tparam NodeSize the size in bytes of a node
+ */
+template<size_t NodeSize>
+class CSSStringTree {
+    std::vector<std::string> strings;
+    std::string common;                  ///< the longest prefix common to all the strings
+    CSSTree<NodeSize, uint64_t> prefixes; ///< prefixes[i] is the packed prefix of strings[i] following common
+
+    static std::vector<uint64_t> make_prefixes(const std::vector<std::string> &strings, size_t skip) {
+        std::vector<uint64_t> result(strings.size());
+        for (size_t i = 0; i < strings.size(); ++i)
+            result[i] = csstree_internal::string_prefix(strings[i].data() + skip, strings[i].size() - skip);
+        return result;
+    }
+
+    static size_t common_prefix_length(const std::vector<std::string> &strings) {
+        if (strings.empty())
+            return 0;
+        auto &first = strings.front();
+        auto &last = strings.back();
+        auto length = std::min(first.size(), last.size());
+        return std::mismatch(first.begin(), first.begin() + length, last.begin()).first - first.begin();
+    }
+
+    template<bool Upper>
+    std::vector<std::string>::const_iterator bound(const std::string &key) const {
+        auto cmp = key.compare(0, common.size(), common);
+        if (cmp != 0)
+            return cmp < 0 ? strings.begin() : strings.end();
+
+        auto prefix = csstree_internal::string_prefix(key.data() + common.size(), key.size() - common.size());
+        auto first = prefixes.lower_bound(prefix);
+        if (first == prefixes.end() || *first != prefix)
+            return strings.begin() + (first - prefixes.begin());
+
+        // gallop to the end of the run of strings sharing the prefix of the key
+        size_t step = 1;
+        while (step < size_t(prefixes.end() - first) && first[step] == prefix)
+            step *= 2;
+        auto last = std::upper_bound(first + step / 2, first + std::min(step, size_t(prefixes.end() - first)), prefix);
+
+        auto run_begin = strings.begin() + (first - prefixes.begin());
+        auto run_end = strings.begin() + (last - prefixes.begin());
+        return Upper ? std::upper_bound(run_begin, run_end, key) : std::lower_bound(run_begin, run_end, key);
+    }
+
+public:
+
+    using const_iterator = std::vector<std::string>::const_iterator;
+
+    /**
+     * Constructs the container with the given strings, which must be sorted.
+     * @param strings the strings of the container
+     * @param n_threads the number of threads used to build the tree, 0 to use all the hardware threads
+     */
+    explicit CSSStringTree(std::vector<std::string> strings, size_t n_threads = 1)
+        : strings(std::move(strings)),
+          common(this->strings.empty() ? std::string()
+                                       : this->strings.front().substr(0, common_prefix_length(this->strings))),
+          prefixes(make_prefixes(this->strings, common.size()), n_threads) {
+        if (!std::is_sorted(this->strings.begin(), this->strings.end()))
+            throw std::invalid_argument("Data must be sorted");
+    }
+
+    /**
+     * Finds an element equivalent to key.
+     * @param key value of the element to search for
+     * @return an iterator to an element equivalent to key. If no such element is found, past-the-end iterator is
+     *         returned
+     */
+    const_iterator find(const std::string &key) const {
+        auto it = lower_bound(key);
+        return it != end() && *it == key ? it : end();
+    }
+
+    /**
+     * Returns an iterator pointing to the first element that is not less than key.
+     * @param key value to compare the elements to
+     * @return an iterator to the first element that is not less than key, or past-the-end iterator if no such element
+     *         is found
+     */
+    const_iterator lower_bound(const std::string &key) const {
+        return bound<false>(key);
+    }
+
+    /**
+     * Returns an iterator pointing to the first element that is greater than key.
+     * @param key value to compare the elements to
+     * @return an iterator to the first element that is greater than key, or past-the-end iterator if no such element
+     *         is found
+     */
+    const_iterator upper_bound(const std::string &key) const {
+        return bound<true>(key);
+    }
+
+    /**
+     * Returns a range containing all elements equivalent to key.
+     * @param key value to compare the elements to
+     * @return a pair of iterators defining the range, as returned by lower_bound and upper_bound
+     */
+    std::pair<const_iterator, const_iterator> equal_range(const std::string &key) const {
+        return {lower_bound(key), upper_bound(key)};
+    }
+
+    /**
+     * Returns an iterator to the first element of the container.
+     * @return an iterator to the first element
+     */
+    const_iterator begin() const {
+        return strings.begin();
+    }
+
+    /**
+     * Returns an iterator to the element following the last element of the container.
+     * @return an iterator to the element following the last element
+     */
+    const_iterator end() const {
+        return strings.end();
+    }
+
+    /**
+     * Returns the size in bytes of the index on the strings, i.e. of the internal nodes and of the prefixes.
+     * @return the size in bytes of the index
+     */
+    size_t size_in_bytes() const {
+        return prefixes.size_in_bytes() + prefixes.size() * sizeof(uint64_t) + common.size();
+    }
+
+    /**
+     * Returns the height of the tree.
+     * @return the height of the tree
+     */
+    size_t height() const {
+        return prefixes.height();
+    }
+
+    /**
+     * Returns the number of elements in the container.
+     * @return the number of elements in the container
+     */
+    size_t size() const {
+        return strings.size();
+    }
+
+};
+
+/**
+ * A static (read-only) container of floating-point values, indexed by a CSSTree on their CSSFloatKey, so that NaNs and
+ * signed zeros are handled consistently and internal nodes are searched as integers (with vector instructions, when
+ * available).
+ *
+ * The elements must be sorted by CSSFloatKey, i.e. in increasing order with NaNs at the end, as done by
+ * std::sort(first, last, CSSFloatTree<...>::less).
+ *
+ * @tparam NodeSize the size in bytes of a node
+ * @tparam F the type of the elements, float or double
+ * @tparam Allocator the allocator of the internal nodes and of the elements owned by the container
+ * @tparam Layout the layout of the nodes, either CSSFullLayout or CSSLevelLayout
+ */
+template<size_t NodeSize, typename F = double, typename Allocator = std::allocator<F>, typename Layout = CSSFullLayout>
+class CSSFloatTree {
+    using bits_type = typename CSSFloatKey<F>::bits_type;
+    using tree_type = CSSTree<NodeSize, F, Allocator, Layout, std::less<bits_type>, CSSFloatKey<F>>;
+
+    tree_type tree;
+
+    explicit CSSFloatTree(tree_type &&tree) : tree(std::move(tree)) {}
+
+public:
+
+    using const_iterator = typename tree_type::const_iterator;
+
+    /**
+     * Returns true if a precedes b in the order of the elements of the container.
+     * @param a the first value
+     * @param b the second value
+     * @return true if a precedes b
+     */
+    static bool less(F a, F b) {
+        return CSSFloatKey<F>()(a) < CSSFloatKey<F>()(b);
+    }
+
+    /**
+     * Constructs the container with the copy of the contents of data, which must be sorted as described above.
+     * @param data the vector to be used as source to initialize the elements of the container with
+     * @param n_threads the number of threads used to check the data and build the tree, 0 to use all the hardware
+     *                  threads
+     * @param alloc the allocator of the internal nodes and of the copy of data
+     */
+    explicit CSSFloatTree(const std::vector<F> &data, size_t n_threads = 1, const Allocator &alloc = Allocator())
+        : tree(data, n_threads, alloc) {}
+
+    /**
+     * Returns a container over the n sorted elements pointed to by data, without copying them, which must outlive the
+     * container.
+     * @param data pointer to the first of the elements, which must be sorted as described above
+     * @param n the number of elements
+     * @param n_threads the number of threads used to check the data and build the tree, 0 to use all the hardware
+     *                  threads
+     * @param alloc the allocator of the internal nodes
+     * @return the container
+     */
+    static CSSFloatTree view(const F *data, size_t n, size_t n_threads = 1, const Allocator &alloc = Allocator()) {
+        return CSSFloatTree(tree_type::view(data, n, n_threads, alloc));
+    }
+
+    /**
+     * Finds the first element equivalent to key, where all NaNs are equivalent and so are the two zeros.
+     * @param key value of the element to search for
+     * @return an iterator to the first element equivalent to key. If no such element is found, past-the-end iterator
+     *         is returned
+     */
+    const_iterator find(F key) const {
+        return tree.find(CSSFloatKey<F>()(key));
+    }
+
+    /**
+     * Returns the number of elements equivalent to key.
+     * @param key value of the elements to count
+     * @return the number of elements equivalent to key
+     */
+    size_t count(F key) const {
+        return tree.count(CSSFloatKey<F>()(key));
+    }
+
+    /**
+     * Returns an iterator pointing to the first element that does not precede key.
+     * @param key value to compare the elements to
+     * @return an iterator to the first element that does not precede key, or past-the-end iterator if no such element
+     *         is found
+     */
+    const_iterator lower_bound(F key) const {
+        return tree.lower_bound(CSSFloatKey<F>()(key));
+    }
+
+    /**
+     * Returns an iterator pointing to the first element that key precedes.
+     * @param key value to compare the elements to
+     * @return an iterator to the first element that key precedes, or past-the-end iterator if no such element is found
+     */
+    const_iterator upper_bound(F key) const {
+        return tree.upper_bound(CSSFloatKey<F>()(key));
+    }
+
+    /**
+     * Returns a range containing all elements equivalent to key.
+     * @param key value to compare the elements to
+     * @return a pair of iterators defining the range, as returned by lower_bound and upper_bound
+     */
+    std::pair<const_iterator, const_iterator> equal_range(F key) const {
+        return tree.equal_range(CSSFloatKey<F>()(key));
+    }
+
+    /**
+     * Returns an iterator to the first element of the container.
+     * @return an iterator to the first element
+     */
+    const_iterator begin() const {
+        return tree.begin();
+    }
+
+    /**
+     * Returns an iterator to the element following the last element of the container.
+     * @return an iterator to the element following the last element
+     */
+    const_iterator end() const {
+        return tree.end();
+    }
+
+    /**
+     * Returns the size in bytes of all the internal nodes in the tree.
+     * @return the size in bytes of the internal nodes
+     */
+    size_t size_in_bytes() const {
+        return tree.size_in_bytes();
+    }
+
+    /**
+     * Returns the height of the tree.
+     * @return the height of the tree
+     */
+    size_t height() const {
+        return tree.height();
+    }
+
+    /**
+     * Returns the number of elements in the container.
+     * @return the number of elements in the container
+     */
+    size_t size() const {
+        return tree.size();
+    }
+
+};
 
 /**
- * A static (read-only) multiway tree stored implicitly, without pointers.
+ * A set of keys that supports insertions and deletions on top of a static CSSTree.
  *
- * The implementation is derived from the paper:
- * Rao, J., & Ross, K. A. (1998). Cache conscious indexing for decision-support in main memory.
+ * Updates are recorded in a small delta, made of a sorted vector of inserted keys and one of erased keys (tombstones),
+ * and lookups merge the answer of the tree with those of the delta. Once the delta reaches a given size, it is frozen
+ * and merged with the tree into a new tree by a background thread, while a new delta receives the following updates.
+ * The new tree replaces the old one at the first update after the rebuild is complete. If the rebuild throws, the
+ * exception is rethrown by that update, which then has no effect, and the frozen delta is kept and merged again.
+ *
+ * As for standard containers, const member functions can be called concurrently, but not concurrently with updates.
  *
  * @tparam NodeSize the size in bytes of a node
- * @tparam K the type of the elements in the container
+ * @tparam K the type of the keys
  */
 template<size_t NodeSize, typename K = int64_t>
-class CSSTree {
-    static_assert(NodeSize >= sizeof(K), "");
+class CSSDynamicTree {
+    using tree_type = CSSTree<NodeSize, K>;
 
-    size_t tree_height;
-    size_t half_marker;
-    size_t n_internal_nodes;
-    std::vector<K> tree;
-    const std::vector<K> leaves;
-    const size_t slots_per_node = NodeSize / sizeof(K);
+    /* A batch of updates, i.e. the keys inserted and the keys erased, each sorted. */
+    struct Delta {
+        std::vector<K> inserted; ///< keys not in the older layers
+        std::vector<K> erased;   ///< keys in the older layers
+
+        size_t size() const {
+            return inserted.size() + erased.size();
+        }
+    };
+
+    std::shared_ptr<const tree_type> tree;         ///< the keys before the updates in frozen and active
+    std::shared_ptr<const Delta> frozen;           ///< the updates being merged into a new tree, if any
+    Delta active;                                  ///< the updates received after the last rebuild started
+    std::future<std::shared_ptr<const tree_type>> pending; ///< the result of the rebuild in progress, if any
+    size_t n_elements;
+    size_t rebuild_threshold;
+
+    static bool contains(const std::vector<K> &v, K key) {
+        return std::binary_search(v.begin(), v.end(), key);
+    }
+
+    static void insert_sorted(std::vector<K> &v, K key) {
+        v.insert(std::lower_bound(v.begin(), v.end(), key), key);
+    }
+
+    static void erase_sorted(std::vector<K> &v, K key) {
+        v.erase(std::lower_bound(v.begin(), v.end(), key));
+    }
 
-    template<class Iterator>
-    inline typename std::vector<K>::const_iterator find_in_leaves(Iterator lo, Iterator hi, K key) const {
-        for (; lo != hi && *lo < key; ++lo);
-        return key == *lo ? lo : end();
+    /* Returns a pointer to the element equivalent to key in the layers older than active, or nullptr. */
+    const K *find_below_active(K key) const {
+        if (frozen) {
+            auto it = std::lower_bound(frozen->inserted.begin(), frozen->inserted.end(), key);
+            if (it != frozen->inserted.end() && !(key < *it))
+                return &*it;
+            if (contains(frozen->erased, key))
+                return nullptr;
+        }
+        auto it = tree->find(key);
+        return it == tree->end() ? nullptr : it;
+    }
+
+    /* Returns the first element of [first, last) not hidden by the given tombstones, or last. */
+    template<typename It>
+    static It skip_erased(It first, It last, const std::vector<K> &erased, const std::vector<K> *older_erased) {
+        while (first != last && (contains(erased, *first) || (older_erased && contains(*older_erased, *first))))
+            ++first;
+        return first;
+    }
+
+    /* Returns a new tree with the keys of tree updated by delta. */
+    static std::shared_ptr<const tree_type> rebuild(const tree_type &tree, const Delta &delta) {
+        return std::make_shared<const tree_type>(tree_type::merge(tree, delta.inserted, delta.erased));
+    }
+
+    /*
+     * Merges the frozen delta into the tree in the background, freezing the active one first unless a failed rebuild
+     * left a frozen delta to retry.
+     */
+    void start_rebuild() {
+        if (!frozen) {
+            frozen = std::make_shared<const Delta>(std::move(active));
+            active = Delta();
+        }
+        auto old_tree = tree;
+        auto delta = frozen;
+        pending = std::async(std::launch::async, [old_tree, delta] { return rebuild(*old_tree, *delta); });
+    }
+
+    /*
+     * Installs the result of the rebuild in progress. If the rebuild failed, its exception is rethrown and the frozen
+     * delta is kept, so that its updates are still visible and merged by the next rebuild.
+     */
+    void finish_rebuild() {
+        tree = pending.get();
+        frozen.reset();
+    }
+
+    /* Installs the result of a completed rebuild, and starts a new one if a delta is waiting to be merged. */
+    void maybe_rebuild() {
+        if (pending.valid() && pending.wait_for(std::chrono::seconds(0)) == std::future_status::ready)
+            finish_rebuild();
+        if (!pending.valid() && (frozen || active.size() >= rebuild_threshold))
+            start_rebuild();
     }
 
 public:
 
     /**
-     * Constructs the container with the copy of the contents of data, which must be sorted.
-     * @param data the vector to be used as source to initialize the elements of the container with
+     * Constructs the container with the given keys, which must be sorted and distinct.
+     * @param data the initial keys of the container
+     * @param rebuild_threshold the number of updates after which the tree is rebuilt in the background
      */
-    explicit CSSTree(const std::vector<K> &data) : leaves(data) {
-        if (!std::is_sorted(data.begin(), data.end()))
-            throw std::invalid_argument("Data must be sorted");
+    explicit CSSDynamicTree(std::vector<K> data = std::vector<K>(), size_t rebuild_threshold = 1 << 16)
+        : n_elements(data.size()), rebuild_threshold(std::max<size_t>(1, rebuild_threshold)) {
+        if (std::adjacent_find(data.begin(), data.end(), [](K a, K b) { return !(a < b); }) != data.end())
+            throw std::invalid_argument("Data must be sorted and without duplicates");
+        tree = std::make_shared<const tree_type>(std::move(data));
+    }
+
+    /**
+     * Inserts key in the container, if it is not already present.
+     * @param key the key to insert
+     * @return true if the key was inserted, false if it was already present
+     */
+    bool insert(K key) {
+        if (find(key))
+            return false;
+        maybe_rebuild();
+        if (contains(active.erased, key))
+            erase_sorted(active.erased, key);
+        else
+            insert_sorted(active.inserted, key);
+        ++n_elements;
+        return true;
+    }
+
+    /**
+     * Removes key from the container, if it is present.
+     * @param key the key to remove
+     * @return true if the key was removed, false if it was not present
+     */
+    bool erase(K key) {
+        if (!find(key))
+            return false;
+        maybe_rebuild();
+        if (contains(active.inserted, key))
+            erase_sorted(active.inserted, key);
+        else
+            insert_sorted(active.erased, key);
+        --n_elements;
+        return true;
+    }
+
+    /**
+     * Finds the element equivalent to key.
+     * @param key key value of the element to search for
+     * @return a pointer to the element equivalent to key, or nullptr if no such element is found. The pointer is valid
+     *         until the next update of the container
+     */
+    const K *find(K key) const {
+        auto it = std::lower_bound(active.inserted.begin(), active.inserted.end(), key);
+        if (it != active.inserted.end() && !(key < *it))
+            return &*it;
+        if (contains(active.erased, key))
+            return nullptr;
+        return find_below_active(key);
+    }
+
+    /**
+     * Returns the first element that is not less than key.
+     * @param key key value to compare the elements to
+     * @return a pointer to the first element that is not less than key, or nullptr if no such element is found. The
+     *         pointer is valid until the next update of the container
+     */
+    const K *lower_bound(K key) const {
+        const K *result = nullptr;
+        auto consider = [&](const K *candidate) {
+            if (!result || *candidate < *result)
+                result = candidate;
+        };
+
+        auto it = std::lower_bound(active.inserted.begin(), active.inserted.end(), key);
+        if (it != active.inserted.end())
+            consider(&*it);
+
+        if (frozen) {
+            auto first = std::lower_bound(frozen->inserted.begin(), frozen->inserted.end(), key);
+            first = skip_erased(first, frozen->inserted.end(), active.erased, nullptr);
+            if (first != frozen->inserted.end())
+                consider(&*first);
+        }
+
+        auto first = skip_erased(tree->lower_bound(key), tree->end(), active.erased,
+                                 frozen ? &frozen->erased : nullptr);
+        if (first != tree->end())
+            consider(first);
+        return result;
+    }
+
+    /**
+     * Merges all the updates into the tree, waiting for the rebuild in progress, if any, and for a final rebuild with
+     * the remaining updates.
+     */
+    void flush() {
+        if (pending.valid())
+            finish_rebuild();
+        while (frozen || active.size() > 0) {
+            start_rebuild();
+            finish_rebuild();
+        }
+    }
+
+    /**
+     * Returns the number of updates not yet merged into the tree.
+     * @return the number of pending updates
+     */
+    size_t pending_updates() const {
+        return active.size() + (frozen ? frozen->size() : 0);
+    }
+
+    /**
+     * Returns the number of elements in the container.
+     * @return the number of elements in the container
+     */
+    size_t size() const {
+        return n_elements;
+    }
+
+};
+
+/**
+ * A handle to the current version of an immutable tree (e.g. a CSSTree), which a writer can replace while many threads
+ * read it, without readers ever taking a lock.
+ *
+ * Each reading thread creates a Reader once, and then pins the current tree for the duration of each read. Pinning
+ * loads the global epoch and the current tree, which are shared by all readers but written only by publish, and stores
+ * the epoch to a cache line private to the reader with a sequentially consistent store, i.e. a full fence on x86.
+ * Unpinning is a release store to the same line. Replaced trees are freed with epoch-based reclamation: a tree is
+ * deleted only once all the readers that pinned it, or could have, have unpinned.
+ *
+ * @tparam Tree the type of the tree
+ */
+template<typename Tree>
+class CSSTreeHandle {
+
+    /* The state of a reader, aligned to a cache line so that readers do not share lines. */
+    struct alignas(64) Record {
+        std::atomic<uint64_t> epoch;  ///< the epoch at which the reader pinned the tree, 0 if not pinning
+        std::atomic<bool> claimed;    ///< whether a Reader is using the record
+        Record *next;                 ///< the next record in the list of all records
+    };
+
+    static_assert(sizeof(Record) == 64, "");
+
+    /* Allocates the records at cache-line boundaries, which new guarantees only from C++17. */
+    using record_allocator = csstree_internal::AlignedAllocator<Record, 64, std::allocator<Record>>;
+
+    std::atomic<const Tree *> current;
+    std::atomic<uint64_t> global_epoch;
+    std::atomic<Record *> records;                               ///< a list to which records are only prepended
+    std::mutex writer;                                           ///< serializes publish and reclaim
+    std::vector<std::pair<uint64_t, const Tree *>> retired;      ///< replaced trees with the epoch of their removal
+
+    Record *claim_record() {
+        for (auto r = records.load(); r; r = r->next)
+            if (!r->claimed.load(std::memory_order_relaxed) && !r->claimed.exchange(true))
+                return r;
+
+        auto r = new(record_allocator().allocate(1)) Record();
+        r->epoch.store(0);
+        r->claimed.store(true);
+        r->next = records.load();
+        while (!records.compare_exchange_weak(r->next, r)) {}
+        return r;
+    }
+
+    /* Deletes the retired trees that no reader can still be using. Must be called with writer locked. */
+    void reclaim() {
+        auto min_epoch = std::numeric_limits<uint64_t>::max();
+        for (auto r = records.load(); r; r = r->next) {
+            auto e = r->epoch.load();
+            if (e != 0)
+                min_epoch = std::min(min_epoch, e);
+        }
+
+        auto in_use = [min_epoch](const std::pair<uint64_t, const Tree *> &t) { return t.first >= min_epoch; };
+        auto it = std::partition(retired.begin(), retired.end(), in_use);
+        for (auto jt = it; jt != retired.end(); ++jt)
+            delete jt->second;
+        retired.erase(it, retired.end());
+    }
+
+public:
+
+    class Reader;
+
+    /** A tree pinned by a Reader, which stays valid until the Pin is destroyed. */
+    class Pin {
+        Record *record;
+        const Tree *tree;
+
+        friend class Reader;
+
+        Pin(Record *record, const Tree *tree) : record(record), tree(tree) {}
+
+    public:
 
+        Pin(const Pin &) = delete;
+
+        Pin &operator=(const Pin &) = delete;
+
+        Pin(Pin &&other) noexcept : record(other.record), tree(other.tree) {
+            other.record = nullptr;
+        }
+
+        ~Pin() {
+            if (record)
+                record->epoch.store(0, std::memory_order_release);
+        }
+
+        const Tree &operator*() const { return *tree; }
+
+        const Tree *operator->() const { return tree; }
+    };
+
+    /** The registration of a reading thread. A Reader must not be used by two threads at the same time. */
+    class Reader {
+        CSSTreeHandle *handle;
+        Record *record;
+
+    public:
+
+        /**
+         * Registers a reader of the given handle, which must outlive it.
+         * @param handle the handle to read from
+         */
+        explicit Reader(CSSTreeHandle &handle) : handle(&handle), record(handle.claim_record()) {}
+
+        Reader(const Reader &) = delete;
+
+        Reader &operator=(const Reader &) = delete;
+
+        ~Reader() {
+            record->claimed.store(false, std::memory_order_release);
+        }
+
+        /**
+         * Pins the current tree, which will not be freed until the returned Pin is destroyed. A Reader can hold at most
+         * one Pin at a time.
+         * @return the pinned tree
+         */
+        Pin pin() const {
+            assert(record->epoch.load(std::memory_order_relaxed) == 0);
+            record->epoch.store(handle->global_epoch.load());
+            return Pin(record, handle->current.load());
+        }
+    };
+
+    /**
+     * Constructs a handle to the given tree.
+     * @param tree the initial tree
+     */
+    explicit CSSTreeHandle(Tree tree) : current(new Tree(std::move(tree))), global_epoch(1), records(nullptr) {}
+
+    CSSTreeHandle(const CSSTreeHandle &) = delete;
+
+    CSSTreeHandle &operator=(const CSSTreeHandle &) = delete;
+
+    /** Destroys the handle and all its trees. No Reader or Pin may be alive. */
+    ~CSSTreeHandle() {
+        delete current.load();
+        for (auto &t : retired)
+            delete t.second;
+        for (auto r = records.load(); r;) {
+            auto next = r->next;
+            r->~Record();
+            record_allocator().deallocate(r, 1);
+            r = next;
+        }
+    }
+
+    /**
+     * Replaces the current tree with the given one. Readers that pin after publish returns see the new tree, and the
+     * old one is freed once no reader uses it, during this or a later call to publish or reclaim_unused.
+     * @param tree the new tree
+     */
+    void publish(Tree tree) {
+        std::unique_ptr<const Tree> next(new Tree(std::move(tree)));
+        std::lock_guard<std::mutex> lock(writer);
+        retired.reserve(retired.size() + 1);
+        auto old = current.exchange(next.release());
+        retired.emplace_back(global_epoch.fetch_add(1), old);
+        reclaim();
+    }
+
+    /**
+     * Frees the replaced trees that are no longer in use by any reader.
+     * @return the number of replaced trees still in use
+     */
+    size_t reclaim_unused() {
+        std::lock_guard<std::mutex> lock(writer);
+        reclaim();
+        return retired.size();
+    }
+
+};
+
+/**
+ * A static (read-only) search tree with a hierarchical blocking in the spirit of FAST:
+ * Kim, C., et al. (2010). FAST: fast architecture sensitive tree search on modern CPUs and GPUs.
+ *
+ * Each node fills a cache line and is searched with vector instructions, when available, in register-sized blocks.
+ * Nodes are in turn grouped into page blocks, subtrees stored within a single page of PageSize bytes, so that a lookup
+ * costs one cache miss per level of the tree but only one TLB miss per page block. A page block either spans as many
+ * levels as fit in a page, with fewer children at its root, or one level less with all its nodes full, in which case
+ * several blocks may share a page; the tree uses the shape that makes it shallower. Like in a CSSTree, the leaves are
+ * the sorted elements themselves.
+ *
+ * @tparam K the type of the elements in the container
+ * @tparam PageSize the size in bytes of a page, a power of two, e.g. 4096 or 2 MB when the tree is backed by huge pages
+ * @tparam Allocator the allocator of the internal nodes and of the elements. The internal nodes are aligned to PageSize
+ */
+template<typename K = int64_t, size_t PageSize = 4096, typename Allocator = std::allocator<K>>
+class CSSFastTree {
+    static_assert(PageSize >= 64 && (PageSize & (PageSize - 1)) == 0, "PageSize must be a power of two");
+    static_assert(sizeof(K) <= 32, "A cache line must hold at least two keys");
+
+    /* The number of keys in a node (and of elements in a leaf node), and the fan-out of the tree. */
+    static constexpr size_t slots_per_node = 64 / sizeof(K);
+    static constexpr size_t fanout = slots_per_node + 1;
+
+    /* The number of nodes, and of keys, in a page. */
+    static constexpr size_t page_nodes = PageSize / 64;
+    static constexpr size_t page_stride = PageSize / sizeof(K);
+
+    /* The number of levels of the deepest page block, whose root has at least two children, and the children of its
+     * root. */
+    static constexpr size_t page_levels = csstree_internal::page_block_levels(fanout, page_nodes);
+    static constexpr size_t page_root_children =
+        page_levels == 1 ? fanout : (page_nodes - 1) / csstree_internal::subtree_nodes(fanout, page_levels - 1);
+    static constexpr size_t page_root_fanout = page_root_children < fanout ? page_root_children : fanout;
+
+    /**
+     * The shape of a page block, a subtree with Levels levels whose root has RootFanout children and whose other nodes
+     * have fanout children. Its nodes are stored in breadth-first order, and blocks are packed in pages without
+     * crossing their boundaries.
+     */
+    template<size_t Levels, size_t RootFanout>
+    struct Block {
+        static constexpr size_t levels = Levels;
+        static constexpr size_t root_fanout = RootFanout;
+        static constexpr size_t nodes = 1 + RootFanout * csstree_internal::subtree_nodes(fanout, Levels - 1);
+        static constexpr size_t per_page = page_nodes / nodes;
+        static constexpr size_t positions = RootFanout * csstree_internal::int_pow(fanout, Levels - 1);
+    };
+
+    /* The block of page_levels levels, and the one of a level less whose root is full, if any. */
+    using deep_block = Block<page_levels, page_root_fanout>;
+    using shallow_block = typename std::conditional<page_root_fanout == fanout, deep_block,
+                                                    Block<page_levels - 1, fanout>>::type;
+
+    using node_search = csstree_internal::NodeSearch<K, slots_per_node>;
+    using node_allocator = csstree_internal::AlignedAllocator<K, PageSize, Allocator>;
+
+    /*
+     * The first page holds the top block, which has top_levels levels and whose root has top_fanout children. It is
+     * followed by the levels of page blocks, of shape deep_block if deep is true and shallow_block otherwise, the j-th
+     * of which starts at page level_pages[j]. The nodes of the last level of page blocks have as children the leaf
+     * nodes, i.e. the groups of slots_per_node consecutive elements.
+     */
+    size_t tree_height;
+    size_t top_levels;
+    size_t top_fanout;
+    bool deep;
+    std::vector<size_t> level_pages;
+    std::vector<K, node_allocator> tree;
+    std::vector<K, Allocator> leaves;
+
+public:
+
+    using const_iterator = const K *;
+
+private:
+
+    template<bool Upper>
+    static inline bool precedes(K sep, K key) {
+        return Upper ? !(key < sep) : sep < key;
+    }
+
+    /* Returns the number of the slots_per_node sorted keys at node that precede the bound of key. */
+    template<bool Upper>
+    static inline size_t search_node(const K *node, K key) {
+        return search_node<Upper>(node, key, std::integral_constant<bool, node_search::vectorized>());
+    }
+
+    template<bool Upper>
+    static inline size_t search_node(const K *node, K key, std::true_type) {
+        return node_search::template search<Upper, false>(node, key);
+    }
+
+    template<bool Upper>
+    static inline size_t search_node(const K *node, K key, std::false_type) {
+        return csstree_internal::Unrolled<slots_per_node>::count(node, key, precedes<Upper>);
+    }
+
+    /*
+     * Descends a block with the given number of levels and root fan-out, which is the i-th block of its level, and
+     * returns the index of the child reached among those of the last level of all the blocks. The keys of the root
+     * past the first root_fanout - 1 repeat the last of them.
+     */
+    template<bool Upper>
+    static inline size_t descend_block(const K *block, size_t levels, size_t root_fanout, size_t i, K key) {
+        size_t p = std::min(search_node<Upper>(block, key), root_fanout - 1); // the index of the node in its level
+        size_t level_begin = 1; // the index in the block of the first node of the next level
+        size_t width = root_fanout;
+        for (size_t r = 1; r < levels; ++r) {
+            p = p * fanout + search_node<Upper>(block + (level_begin + p) * slots_per_node, key);
+            level_begin += width;
+            width *= fanout;
+        }
+        return i * width + p;
+    }
+
+    /* Returns the offset in tree of the i-th block of shape B in the level of blocks starting at the given page. */
+    template<typename B>
+    static inline size_t block_offset(size_t page, size_t i) {
+        return (page + i / B::per_page) * page_stride + i % B::per_page * B::nodes * slots_per_node;
+    }
+
+    /* Descends the levels of page blocks of shape B from the i-th child of the top block. */
+    template<bool Upper, typename B>
+    inline size_t descend_pages(size_t i, K key) const {
+        for (auto page : level_pages)
+            i = descend_block<Upper>(tree.data() + block_offset<B>(page, i), B::levels, B::root_fanout, i, key);
+        return i;
+    }
+
+    template<bool Upper>
+    inline const_iterator bound(K key) const {
+        // if key does not precede the last element, every subtree visited contains some element
         const auto n = leaves.size();
-        const auto leaf_nodes = ceil(n / double(slots_per_node));
-        tree_height = size_t(ceil(log(leaf_nodes) / log(slots_per_node + 1)));
-        const auto expp = size_t(pow(slots_per_node + 1, tree_height));
-        const auto last_internal_node = size_t((expp - leaf_nodes) / slots_per_node);
-        n_internal_nodes = (size_t) ((expp - 1) / slots_per_node) - last_internal_node;
-        tree = std::vector<K>(n_internal_nodes * slots_per_node);
-        half_marker = (expp - 1) / slots_per_node;
+        if (n == 0 || precedes<Upper>(leaves[n - 1], key))
+            return end();
 
-        size_t i = tree.size();
-        while (i-- > 0) {
-            auto node = i / slots_per_node;
-            auto child = node * (slots_per_node + 1) + 1 + i % slots_per_node;
-            while (child < n_internal_nodes) // follow rightmost branch
-                child = child * (slots_per_node + 1) + slots_per_node + 1;
+        size_t i = 0; // the index of the leaf node reached
+        if (tree_height > 0) {
+            i = descend_block<Upper>(tree.data(), top_levels, top_fanout, 0, key);
+            i = deep ? descend_pages<Upper, deep_block>(i, key) : descend_pages<Upper, shallow_block>(i, key);
+        }
 
-            // child is a leaf -> map it to an index in the tree
-            long diff = (child - half_marker) * slots_per_node;
-            if (diff < 0)
-                tree[i] = leaves[diff + n + slots_per_node - 1];
-            else if (diff + slots_per_node - 1 < n - last_internal_node * slots_per_node)
-                tree[i] = leaves[diff + slots_per_node - 1];
-            else
-                // special case: fill ancestor of the last leaf node with the
-                // last element of (the biggest in) the first half of the tree
-                tree[i] = leaves[n - last_internal_node * slots_per_node - 1];
+        auto offset = i * slots_per_node;
+        auto lo = begin() + offset;
+        if (n - offset >= slots_per_node)
+            return lo + search_node<Upper>(lo, key);
+
+        size_t count = 0;
+        for (auto it = lo; it != end(); ++it)
+            count += precedes<Upper>(*it, key);
+        return lo + count;
+    }
+
+    /*
+     * Fills the i-th block of a level, with the given number of levels and root fan-out, whose last level of nodes has
+     * children spanning leaf_nodes_per_child leaf nodes each.
+     */
+    void fill_block(K *block, size_t levels, size_t root_fanout, size_t i, size_t leaf_nodes_per_child) {
+        // the separator of a child is the largest element in its subtree, or the last element if the subtree is empty
+        const auto n = leaves.size();
+        size_t width = 1;
+        for (size_t r = 0; r < levels; ++r) {
+            auto node_fanout = r == 0 ? root_fanout : fanout;
+            auto child_span = leaf_nodes_per_child * csstree_internal::int_pow(fanout, levels - r - 1);
+            auto first_child = i * width * node_fanout;
+            for (size_t p = 0; p < width; ++p) {
+                for (size_t c = 0; c < slots_per_node; ++c) {
+                    auto child = first_child + p * node_fanout + std::min(c, node_fanout - 2);
+                    *block++ = leaves[std::min(n, (child + 1) * child_span * slots_per_node) - 1];
+                }
+            }
+            width *= node_fanout;
+        }
+    }
+
+    /* Returns the height of a tree over the given number of leaf nodes with page blocks of shape B. */
+    template<typename B>
+    static size_t height_with(size_t leaf_nodes) {
+        auto block_levels = csstree_internal::ceil_log(B::positions, leaf_nodes) - 1;
+        auto span = csstree_internal::int_pow(B::positions, block_levels);
+        return csstree_internal::ceil_log(fanout, (leaf_nodes + span - 1) / span) + block_levels * B::levels;
+    }
+
+    /* Builds the tree with page blocks of shape B. */
+    template<typename B>
+    void build_with(size_t leaf_nodes) {
+        // the top block has just enough levels, and its root just enough children, to reach all the leaf nodes
+        auto block_levels = csstree_internal::ceil_log(B::positions, leaf_nodes) - 1;
+        auto span = csstree_internal::int_pow(B::positions, block_levels); // the leaf nodes below a top block child
+        auto top_positions = (leaf_nodes + span - 1) / span;
+        top_levels = csstree_internal::ceil_log(fanout, top_positions);
+        auto top_width = csstree_internal::int_pow(fanout, top_levels - 1);
+        top_fanout = (top_positions + top_width - 1) / top_width;
+        tree_height = top_levels + block_levels * B::levels;
+
+        size_t pages = 1;
+        for (auto level_span = span; level_span > 1; level_span /= B::positions) {
+            auto blocks = (leaf_nodes + level_span - 1) / level_span;
+            level_pages.push_back(pages);
+            pages += (blocks + B::per_page - 1) / B::per_page;
+        }
+
+        tree.resize(pages * page_stride);
+        fill_block(tree.data(), top_levels, top_fanout, 0, span);
+        for (size_t j = 0; j < block_levels; ++j) {
+            span /= B::positions;
+            auto blocks = (leaf_nodes + span * B::positions - 1) / (span * B::positions);
+            for (size_t b = 0; b < blocks; ++b)
+                fill_block(tree.data() + block_offset<B>(level_pages[j], b), B::levels, B::root_fanout, b, span);
         }
     }
 
+    void build() {
+        const auto leaf_nodes = (leaves.size() + slots_per_node - 1) / slots_per_node;
+        if (leaf_nodes <= 1)
+            return;
+
+        // the deep blocks need fewer of them per lookup, the shallow ones may need fewer levels overall
+        deep = height_with<deep_block>(leaf_nodes) <= height_with<shallow_block>(leaf_nodes);
+        if (deep)
+            build_with<deep_block>(leaf_nodes);
+        else
+            build_with<shallow_block>(leaf_nodes);
+    }
+
+public:
+
+    /**
+     * Constructs the container with the given elements, which must be sorted.
+     * @param data the elements of the container
+     * @param alloc the allocator of the internal nodes and of the elements
+     */
+    explicit CSSFastTree(const std::vector<K> &data, const Allocator &alloc = Allocator())
+        : tree_height(0), top_levels(0), top_fanout(0), deep(true), tree(node_allocator(alloc)),
+          leaves(data.begin(), data.end(), alloc) {
+        if (!std::is_sorted(leaves.begin(), leaves.end()))
+            throw std::invalid_argument("Data must be sorted");
+        if (!leaves.empty())
+            build();
+    }
+
     /**
-     * Finds an element with key equivalent to key.
+     * Finds the first element equivalent to key.
      * @param key key value of the element to search for
-     * @return an iterator to an element with key equivalent to key. If no such element is found, past-the-end iterator
+     * @return an iterator to the first element equivalent to key. If no such element is found, past-the-end iterator
      *         is returned
      */
-    inline typename std::vector<K>::const_iterator find(K key) const {
-        if (n_internal_nodes == 0)
-            return find_in_leaves(leaves.cbegin(), leaves.cend(), key);
+    inline const_iterator find(K key) const {
+        auto it = lower_bound(key);
+        return it != end() && !(key < *it) ? it : end();
+    }
 
-        size_t child = 0;
-        while (child < n_internal_nodes) {
-            auto index_in_tree = child * slots_per_node;
-            if (NodeSize > 256) { // use binary search for large pages and scan for smaller ones
-                auto lo = tree.cbegin() + index_in_tree;
-                auto hi = std::min(tree.cend(), lo + slots_per_node + 1);
-                auto pos = std::lower_bound(lo, hi, key);
-                if (pos == hi)
-                    --pos;
-                child = child * (slots_per_node + 1) + 1 + std::distance(lo, pos);
-            } else {
-                size_t lo;
-                for (lo = 0; lo < slots_per_node && tree[index_in_tree + lo] < key; ++lo);
-                child = child * (slots_per_node + 1) + 1 + lo;
-            }
-        }
+    /**
+     * Returns an iterator pointing to the first element that is not less than key.
+     * @param key key value to compare the elements to
+     * @return an iterator to the first element that is not less than key, or past-the-end iterator if no such
+     *         element is found
+     */
+    inline const_iterator lower_bound(K key) const {
+        return bound<false>(key);
+    }
 
-        long diff = (long(child) - long(half_marker)) * slots_per_node;
-        if (diff < 0)
-            diff += leaves.size();
-        assert(diff >= 0);
+    /**
+     * Returns an iterator pointing to the first element that is greater than key.
+     * @param key key value to compare the elements to
+     * @return an iterator to the first element that is greater than key, or past-the-end iterator if no such
+     *         element is found
+     */
+    inline const_iterator upper_bound(K key) const {
+        return bound<true>(key);
+    }
 
-        auto lo = leaves.cbegin() + std::min(leaves.size(), size_t(diff));
-        auto hi = leaves.cbegin() + std::min(leaves.size(), diff + slots_per_node);
-        return find_in_leaves(lo, hi, key);
+    /**
+     * Returns a range containing all elements equivalent to key.
+     * @param key key value to compare the elements to
+     * @return a pair of iterators defining the range, as returned by lower_bound and upper_bound
+     */
+    inline std::pair<const_iterator, const_iterator> equal_range(K key) const {
+        return {lower_bound(key), upper_bound(key)};
     }
 
     /**
-     * Returns an iterator to the first element of the container; that is, the first leaf element.
+     * Returns an iterator to the first element of the container.
      * @return an iterator to the first element
      */
-    typename std::vector<K>::const_iterator begin() const {
-        return leaves.cbegin();
+    const_iterator begin() const {
+        return leaves.data();
     }
 
     /**
      * Returns an iterator to the element following the last element of the container.
      * @return an iterator to the element following the last element
      */
-    typename std::vector<K>::const_iterator end() const {
-        return leaves.cend();
+    const_iterator end() const {
+        return leaves.data() + leaves.size();
     }
 
     /**
@@ -171,3 +2877,9 @@ public:
     }
 
 };
+
+template<typename K, size_t PageSize, typename Allocator>
+constexpr size_t CSSFastTree<K, PageSize, Allocator>::slots_per_node;
+
+template<typename K, size_t PageSize, typename Allocator>
+constexpr size_t CSSFastTree<K, PageSize, Allocator>::fanout;
@@ -9,6 +9,15 @@
 #include <vector>
 #include <random>
 #include <algorithm>
+#include <cstdio>
+#include <fstream>
+#include <limits>
+#include <numeric>
+#include <set>
+#include <thread>
+#include <atomic>
+#include <sstream>
+#include <string>
 
 TEST_CASE("collection methods") {
     std::vector<int32_t> data = {-3, 2, 4, 11, 35, 60};
@@ -41,6 +50,92 @@ TEST_CASE("collection methods") {
     }
 }
 
+TEST_CASE("non-owning") {
+    std::vector<int32_t> data(1000);
+    for (size_t i = 0; i < data.size(); ++i)
+        data[i] = int32_t(i * 2);
+    auto css = CSSTree<16, int32_t>::view(data.data(), data.size());
+    REQUIRE(css.begin() == data.data());
+    REQUIRE(css.end() == data.data() + data.size());
+    REQUIRE(css.find(500) == data.data() + 250);
+    REQUIRE(css.find(501) == css.end());
+
+    CSSTree<16, int32_t> copy(css);
+    REQUIRE(copy.begin() == data.data());
+    REQUIRE(copy.find(998) == data.data() + 499);
+
+    CSSTree<16, int32_t> owning(data);
+    copy = owning;
+    REQUIRE(copy.begin() != data.data());
+    REQUIRE(copy.begin() != owning.begin());
+    REQUIRE(*copy.find(998) == 998);
+
+    // braced lists starting with 0 are not taken for a pointer and a size
+    CSSTree<64, int32_t> pair({0, 5});
+    CSSTree<64, int32_t> triple({0, 5, 9});
+    CSSFloatTree<64, float> floats({0, 5});
+    REQUIRE(pair.size() == 2);
+    REQUIRE(*triple.find(9) == 9);
+    REQUIRE(*floats.find(5.f) == 5.f);
+}
+
+TEST_CASE("move") {
+    std::vector<int32_t> data(1000);
+    for (size_t i = 0; i < data.size(); ++i)
+        data[i] = int32_t(i * 2);
+    auto buffer = data.data();
+
+    CSSTree<16, int32_t> css(std::move(data));
+    REQUIRE(css.begin() == buffer);
+    REQUIRE(*css.find(500) == 500);
+
+    CSSTree<16, int32_t> moved(std::move(css));
+    REQUIRE(moved.begin() == buffer);
+    REQUIRE(*moved.find(500) == 500);
+    REQUIRE(css.size() == 0);
+    REQUIRE(css.find(500) == css.end());
+
+    CSSTree<16, int32_t> assigned({1, 2, 3});
+    assigned = std::move(moved);
+    REQUIRE(assigned.begin() == buffer);
+    REQUIRE(assigned.size() == 1000);
+    REQUIRE(*assigned.find(998) == 998);
+
+    using Tree = CSSTree<16, int32_t>;
+    std::vector<int32_t> unsorted = {3, 2, 1};
+    REQUIRE_THROWS_AS(Tree(std::move(unsorted)), std::invalid_argument);
+    REQUIRE(unsorted.size() == 3);
+}
+
+TEST_CASE("geometry") {
+    // 16 keys per node, so the height grows when the number of leaf nodes exceeds a power of 17
+    for (size_t height = 0; height <= 3; ++height) {
+        size_t leaf_nodes = 1;
+        for (size_t i = 0; i < height; ++i)
+            leaf_nodes *= 17;
+        for (auto n : {16 * leaf_nodes - 1, 16 * leaf_nodes, 16 * leaf_nodes + 1}) {
+            std::vector<int32_t> data(n);
+            std::iota(data.begin(), data.end(), 0);
+            CSSTree<64, int32_t> css(data);
+            REQUIRE(css.height() == (n > 16 * leaf_nodes ? height + 1 : height));
+            for (size_t i = 0; i < n; i += 1 + n / 1000)
+                REQUIRE(css.find(int32_t(i)) - css.begin() == long(i));
+            REQUIRE(css.find(int32_t(n)) == css.end());
+        }
+    }
+
+    static_assert(csstree_internal::ceil_log(2, std::numeric_limits<size_t>::max()) == 64, "");
+    static_assert(csstree_internal::ceil_log(17, std::numeric_limits<size_t>::max()) == 16, "");
+
+    CSSTree<64, int32_t> empty(std::vector<int32_t>{});
+    REQUIRE(empty.size() == 0);
+    REQUIRE(empty.height() == 0);
+    REQUIRE(empty.find(1) == empty.end());
+    REQUIRE(empty.lower_bound(1) == empty.begin());
+    CSSStringTree<64> empty_strings({});
+    REQUIRE(empty_strings.find("a") == empty_strings.end());
+}
+
 TEST_CASE("find") {
     CSSTree<2, int16_t> css({1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15, 16, 17});
     REQUIRE(*css.find(8) == 8);
@@ -58,4 +153,875 @@ TEST_CASE("large data") {
     for (auto key : data)
         REQUIRE(*css.find(key) == key);
     REQUIRE(css.find(data.back() + 100) == css.end());
-}
\ No newline at end of file
+}
+
+TEST_CASE("lower_bound/upper_bound") {
+    std::vector<int32_t> data(10000);
+    std::generate(data.begin(), data.end(), [] { return std::rand() % 5000; });
+    std::sort(data.begin(), data.end());
+    CSSTree<64, int32_t> css(data);
+    for (int32_t key = -10; key < 5010; ++key) {
+        auto lb = std::lower_bound(data.cbegin(), data.cend(), key) - data.cbegin();
+        auto ub = std::upper_bound(data.cbegin(), data.cend(), key) - data.cbegin();
+        REQUIRE(css.lower_bound(key) - css.begin() == lb);
+        REQUIRE(css.upper_bound(key) - css.begin() == ub);
+        auto range = css.equal_range(key);
+        REQUIRE(range.first - css.begin() == lb);
+        REQUIRE(range.second - css.begin() == ub);
+    }
+}
+
+TEST_CASE("level layout") {
+    std::vector<int32_t> data(20000);
+    std::generate(data.begin(), data.end(), [] { return std::rand() % 10000; });
+    std::sort(data.begin(), data.end());
+    LevelCSSTree<64, int32_t> css64(data);
+    LevelCSSTree<128, int32_t> css128(data);
+    LevelCSSTree<24, int32_t> css24(data);
+    for (int32_t key = -10; key < 10010; ++key) {
+        auto lb = std::lower_bound(data.cbegin(), data.cend(), key) - data.cbegin();
+        auto ub = std::upper_bound(data.cbegin(), data.cend(), key) - data.cbegin();
+        REQUIRE(css64.lower_bound(key) - css64.begin() == lb);
+        REQUIRE(css64.upper_bound(key) - css64.begin() == ub);
+        REQUIRE(css128.lower_bound(key) - css128.begin() == lb);
+        REQUIRE(css24.upper_bound(key) - css24.begin() == ub);
+    }
+
+    std::stringstream stream;
+    css64.save(stream);
+    std::stringstream copy(stream.str());
+    auto loaded = LevelCSSTree<64, int32_t>::load(stream);
+    for (int32_t key = -10; key < 10010; key += 3)
+        REQUIRE(loaded.lower_bound(key) - loaded.begin() == css64.lower_bound(key) - css64.begin());
+    using FullTree = CSSTree<64, int32_t>;
+    REQUIRE_THROWS_AS(FullTree::load(copy), std::runtime_error);
+}
+
+struct Record {
+    uint32_t id;
+    double price;
+};
+
+struct ById {
+    uint32_t operator()(const Record &r) const { return r.id; }
+};
+
+TEST_CASE("comparator and projection") {
+    SECTION("descending") {
+        std::vector<uint64_t> data(20000);
+        std::mt19937_64 gen(3);
+        std::generate(data.begin(), data.end(), [&] { return gen() % 10000 + (gen() % 2 ? UINT64_MAX - 20000 : 0); });
+        std::sort(data.begin(), data.end(), std::greater<uint64_t>());
+        using Tree = CSSTree<64, uint64_t, std::allocator<uint64_t>, CSSFullLayout, std::greater<uint64_t>>;
+        using BigTree = CSSTree<512, uint64_t, std::allocator<uint64_t>, CSSFullLayout, std::greater<uint64_t>>;
+        Tree css(data);
+        BigTree big(data);
+        for (int i = 0; i < 20000; ++i) {
+            auto key = i % 2 ? data[gen() % data.size()] : gen();
+            auto lb = std::lower_bound(data.cbegin(), data.cend(), key, std::greater<uint64_t>()) - data.cbegin();
+            auto ub = std::upper_bound(data.cbegin(), data.cend(), key, std::greater<uint64_t>()) - data.cbegin();
+            REQUIRE(css.lower_bound(key) - css.begin() == lb);
+            REQUIRE(css.upper_bound(key) - css.begin() == ub);
+            REQUIRE(big.lower_bound(key) - big.begin() == lb);
+            REQUIRE(big.upper_bound(key) - big.begin() == ub);
+        }
+        std::sort(data.begin(), data.end());
+        REQUIRE_THROWS_AS(Tree(data), std::invalid_argument);
+    }
+
+    SECTION("projection") {
+        std::vector<Record> records(10000);
+        for (size_t i = 0; i < records.size(); ++i)
+            records[i] = {uint32_t(i / 3 * 2), double(i)};
+        using Tree = CSSTree<64, Record, std::allocator<Record>, CSSFullLayout, std::less<uint32_t>, ById>;
+        auto css = Tree::view(records.data(), records.size());
+        for (uint32_t id = 0; id < 7000; ++id) {
+            auto it = css.find(id);
+            auto present = id % 2 == 0 && id <= 6666;
+            if (present)
+                REQUIRE(it->price == double(id / 2 * 3));
+            else
+                REQUIRE(it == css.end());
+            auto range = css.equal_range(id);
+            REQUIRE(range.second - range.first == (!present ? 0 : id == 6666 ? 1 : 3));
+        }
+    }
+}
+
+template<typename Tree, typename K>
+void check_bounds(const Tree &tree, const std::vector<K> &data, const std::vector<K> &keys) {
+    for (auto key : keys) {
+        auto lb = std::lower_bound(data.cbegin(), data.cend(), key) - data.cbegin();
+        auto ub = std::upper_bound(data.cbegin(), data.cend(), key) - data.cbegin();
+        REQUIRE(tree.lower_bound(key) - tree.begin() == lb);
+        REQUIRE(tree.upper_bound(key) - tree.begin() == ub);
+        REQUIRE((tree.find(key) != tree.end()) == (lb != ub));
+    }
+}
+
+TEST_CASE("FAST layout") {
+    std::mt19937_64 gen(11);
+    // 16 keys per node: page blocks reach 289 or 867 leaf nodes with 4 KB pages, and 17 or 51 with 256-byte pages
+    for (size_t n : {0, 1, 15, 16, 17, 300, 816, 817, 4624, 4625, 13872, 13873, 41616, 41617, 100000, 1234567}) {
+        std::vector<uint32_t> data(n);
+        std::generate(data.begin(), data.end(), [&] { return uint32_t(gen() % (4 * n + 1)); });
+        std::sort(data.begin(), data.end());
+        std::vector<uint32_t> keys(5000);
+        std::generate(keys.begin(), keys.end(), [&] { return uint32_t(gen() % (4 * n + 3)); });
+        keys.push_back(0);
+        keys.push_back(UINT32_MAX);
+
+        CSSFastTree<uint32_t> css(data);
+        REQUIRE(css.size() == n);
+        REQUIRE(css.size_in_bytes() % 4096 == 0);
+        REQUIRE(css.height() == CSSTree<64, uint32_t>(data).height());
+        check_bounds(css, data, keys);
+        CSSFastTree<uint32_t, 256> small_pages(data);
+        REQUIRE(small_pages.height() == css.height());
+        check_bounds(small_pages, data, keys);
+    }
+
+    std::vector<int64_t> data(200000);
+    std::generate(data.begin(), data.end(), [&] { return int64_t(gen() % 100000) - 50000; });
+    std::sort(data.begin(), data.end());
+    std::vector<int64_t> keys(data.begin(), data.begin() + 1000);
+    for (int64_t key = -50010; key < 50010; key += 13)
+        keys.push_back(key);
+    check_bounds(CSSFastTree<int64_t>(data), data, keys);
+    check_bounds(CSSFastTree<int64_t, 2 << 20>(data), data, keys);
+
+    std::vector<double> doubles(data.begin(), data.end());
+    std::vector<double> double_keys(keys.begin(), keys.end());
+    check_bounds(CSSFastTree<double>(doubles), doubles, double_keys);
+
+    using Tree = CSSFastTree<int64_t>;
+    REQUIRE_THROWS_AS(Tree({2, 1}), std::invalid_argument);
+}
+
+TEST_CASE("node search") {
+    std::vector<uint64_t> data(100000);
+    std::mt19937_64 gen(42);
+    std::generate(data.begin(), data.end(), std::ref(gen));
+    data.push_back(0);
+    data.push_back(UINT64_MAX);
+    std::sort(data.begin(), data.end());
+    CSSTree<64, uint64_t> css(data);
+    for (auto key : data) {
+        REQUIRE(*css.find(key) == key);
+        REQUIRE(css.upper_bound(key) - css.lower_bound(key) == 1);
+    }
+    for (int i = 0; i < 10000; ++i) {
+        auto key = gen();
+        auto expected = std::lower_bound(data.cbegin(), data.cend(), key) - data.cbegin();
+        REQUIRE(css.lower_bound(key) - css.begin() == expected);
+    }
+}
+
+template<size_t NodeSize, typename K, typename Compare>
+void check_node_search(std::mt19937_64 &gen) {
+    std::vector<K> data(20000);
+    std::generate(data.begin(), data.end(), [&] { return K(gen() % 50000); });
+    data.push_back(std::numeric_limits<K>::min());
+    data.push_back(std::numeric_limits<K>::max());
+    std::sort(data.begin(), data.end(), Compare());
+    std::vector<K> keys(data.begin(), data.end());
+    for (int i = 0; i < 1000; ++i)
+        keys.push_back(K(gen()));
+
+    CSSTree<NodeSize, K, std::allocator<K>, CSSFullLayout, Compare> css(data);
+    for (auto key : keys) {
+        auto lb = std::lower_bound(data.cbegin(), data.cend(), key, Compare()) - data.cbegin();
+        auto ub = std::upper_bound(data.cbegin(), data.cend(), key, Compare()) - data.cbegin();
+        REQUIRE(css.lower_bound(key) - css.begin() == lb);
+        REQUIRE(css.upper_bound(key) - css.begin() == ub);
+    }
+}
+
+template<size_t NodeSize>
+void check_node_search(std::mt19937_64 &gen) {
+    check_node_search<NodeSize, int32_t, std::less<int32_t>>(gen);
+    check_node_search<NodeSize, uint32_t, std::less<uint32_t>>(gen);
+    check_node_search<NodeSize, int64_t, std::less<int64_t>>(gen);
+    check_node_search<NodeSize, uint64_t, std::greater<uint64_t>>(gen);
+}
+
+TEST_CASE("node search widths") {
+    // nodes of different sizes are searched with registers of different widths, selected at run time unless the
+    // widest instruction set the processor supports is enabled at compile time
+    std::mt19937_64 gen(5);
+    check_node_search<16>(gen);
+    check_node_search<32>(gen);
+    check_node_search<64>(gen);
+    check_node_search<128>(gen);
+    check_node_search<256>(gen);
+}
+
+TEST_CASE("scalar fallback") {
+#ifndef __SSE4_2__
+    // without SSE4.2 enabled at compile time, only the searches selected at run time may use vector instructions
+    static_assert(csstree_internal::simd_width(64) == 0, "");
+    static_assert(!csstree_internal::NodeSearch<uint32_t, 4>::vectorized, "");
+    static_assert(!csstree_internal::NodeSearch<int64_t, 8>::vectorized, "");
+#endif
+#if defined(CSSTREE_DISPATCH) && defined(CSSTREE_CPU_SIMD_WIDTH)
+    REQUIRE(csstree_internal::cpu_simd_width() == CSSTREE_CPU_SIMD_WIDTH);
+#endif
+
+    std::mt19937_64 gen(9);
+    check_node_search<16>(gen);
+    check_node_search<48>(gen);
+    check_node_search<64>(gen);
+
+    std::vector<uint32_t> data(50000);
+    std::generate(data.begin(), data.end(), [&] { return uint32_t(gen() % 200000); });
+    std::sort(data.begin(), data.end());
+    std::vector<uint32_t> keys(2000);
+    std::generate(keys.begin(), keys.end(), [&] { return uint32_t(gen() % 200010); });
+    check_bounds(CSSFastTree<uint32_t>(data), data, keys);
+
+    CSSTree<64, uint32_t> css(data);
+    std::vector<CSSTree<64, uint32_t>::const_iterator> results;
+    css.find_batch(keys.data(), keys.size(), std::back_inserter(results));
+    for (size_t i = 0; i < keys.size(); ++i)
+        REQUIRE(results[i] == css.find(keys[i]));
+}
+
+TEST_CASE("duplicates") {
+    std::vector<int32_t> data;
+    for (int32_t key = 0; key < 50; ++key)
+        data.insert(data.end(), key % 7 == 0 ? 20000 : key % 3 + 1, key);
+    CSSTree<64, int32_t> css(data);
+    LevelCSSTree<256, int32_t> level(data);
+    for (int32_t key = -1; key <= 50; ++key) {
+        auto lb = std::lower_bound(data.cbegin(), data.cend(), key) - data.cbegin();
+        auto ub = std::upper_bound(data.cbegin(), data.cend(), key) - data.cbegin();
+        REQUIRE(css.count(key) == size_t(ub - lb));
+        REQUIRE(level.count(key) == size_t(ub - lb));
+        if (lb != ub) {
+            REQUIRE(css.find(key) - css.begin() == lb);
+            REQUIRE(level.find(key) - level.begin() == lb);
+        }
+        auto range = css.equal_range(key);
+        REQUIRE(range.first - css.begin() == lb);
+        REQUIRE(range.second - css.begin() == ub);
+    }
+
+    std::vector<int32_t> keys(data.size(), 0);
+    CSSMap<64, int32_t, int32_t> map(data, keys);
+    REQUIRE(map.count(7) == 20000);
+    REQUIRE(map.find(7) - map.begin() == std::lower_bound(data.cbegin(), data.cend(), 7) - data.cbegin());
+}
+
+TEST_CASE("find_batch") {
+    std::vector<int64_t> data(100000);
+    std::generate(data.begin(), data.end(), [] { return std::rand() % 1000000; });
+    std::sort(data.begin(), data.end());
+    CSSTree<64, int64_t> css(data);
+
+    std::vector<int64_t> keys(1001);
+    std::generate(keys.begin(), keys.end(), [] { return std::rand() % 1000010 - 5; });
+    std::vector<CSSTree<64, int64_t>::const_iterator> results;
+    css.find_batch(keys.data(), keys.size(), std::back_inserter(results));
+    REQUIRE(results.size() == keys.size());
+    for (size_t i = 0; i < keys.size(); ++i)
+        REQUIRE(results[i] == css.find(keys[i]));
+
+    CSSTree<16, int64_t> small({1, 2, 3});
+    std::vector<CSSTree<16, int64_t>::const_iterator> small_results(4);
+    int64_t small_keys[] = {3, 0, 1, 4};
+    small.find_batch(small_keys, 4, small_results.begin());
+    REQUIRE(small_results[0] - small.begin() == 2);
+    REQUIRE(small_results[1] == small.end());
+    REQUIRE(small_results[2] == small.begin());
+    REQUIRE(small_results[3] == small.end());
+}
+
+TEST_CASE("rank/select") {
+    std::vector<uint32_t> data(30000);
+    std::generate(data.begin(), data.end(), [] { return std::rand() % 50000; });
+    std::sort(data.begin(), data.end());
+    auto css = CSSTree<64, uint32_t>::view(data.data(), data.size());
+
+    std::vector<uint32_t> keys(3001);
+    std::generate(keys.begin(), keys.end(), [] { return std::rand() % 50010; });
+    std::vector<size_t> ranks, positions;
+    css.rank_batch(keys.data(), keys.size(), std::back_inserter(ranks));
+    css.position_of_batch(keys.data(), keys.size(), std::back_inserter(positions));
+    for (size_t i = 0; i < keys.size(); ++i) {
+        auto key = keys[i];
+        auto lb = size_t(std::lower_bound(data.cbegin(), data.cend(), key) - data.cbegin());
+        auto ub = size_t(std::upper_bound(data.cbegin(), data.cend(), key) - data.cbegin());
+        REQUIRE(css.rank(key) == lb);
+        REQUIRE(ranks[i] == lb);
+        REQUIRE(css.position_of(key) == (lb != ub ? lb : data.size()));
+        REQUIRE(positions[i] == css.position_of(key));
+        REQUIRE(css.position_range(key) == std::make_pair(lb, ub));
+    }
+    for (size_t i = 0; i < data.size(); i += 7)
+        REQUIRE(css.select(i) == data[i]);
+}
+
+struct Low32 {
+    int32_t operator()(int64_t x) const { return int32_t(x); }
+};
+
+struct UnseekableBuffer : std::streambuf {
+    explicit UnseekableBuffer(std::string &bytes) { setg(&bytes[0], &bytes[0], &bytes[0] + bytes.size()); }
+};
+
+TEST_CASE("save/load/map") {
+    std::vector<int64_t> data(12345);
+    std::generate(data.begin(), data.end(), [] { return std::rand() % 100000; });
+    std::sort(data.begin(), data.end());
+    using Tree = CSSTree<64, int64_t>;
+    Tree css(data);
+
+    std::stringstream stream;
+    css.save(stream);
+    auto loaded = Tree::load(stream);
+    REQUIRE(loaded.size() == css.size());
+    REQUIRE(loaded.height() == css.height());
+    REQUIRE(std::equal(loaded.begin(), loaded.end(), data.cbegin()));
+    for (int64_t key = -1; key < 100001; key += 7)
+        REQUIRE(loaded.lower_bound(key) - loaded.begin() == css.lower_bound(key) - css.begin());
+
+    SECTION("wrong type") {
+        std::stringstream copy(stream.str());
+        using OtherTree = CSSTree<128, int64_t>;
+        REQUIRE_THROWS_AS(OtherTree::load(copy), std::runtime_error);
+        std::stringstream other_order(stream.str());
+        using DescendingTree = CSSTree<64, int64_t, std::allocator<int64_t>, CSSFullLayout, std::greater<int64_t>>;
+        REQUIRE_THROWS_AS(DescendingTree::load(other_order), std::runtime_error);
+        std::stringstream other_key(stream.str());
+        using ProjectedTree = CSSTree<64, int64_t, std::allocator<int64_t>, CSSFullLayout, std::less<int32_t>, Low32>;
+        REQUIRE_THROWS_AS(ProjectedTree::load(other_key), std::runtime_error);
+        std::stringstream truncated(stream.str().substr(0, 1000));
+        REQUIRE_THROWS_AS(Tree::load(truncated), std::runtime_error);
+    }
+
+    SECTION("corrupted size") {
+        // with two children per node, the height of a tree over this many elements overflows the fan-out powers
+        using BinaryTree = CSSTree<8, int64_t>;
+        std::stringstream binary_stream;
+        BinaryTree(data).save(binary_stream);
+        auto bytes = binary_stream.str();
+        csstree_internal::FileHeader header;
+        std::memcpy(&header, bytes.data(), sizeof(header));
+        header.n_elements = ~uint64_t(0);
+        std::memcpy(&bytes[0], &header, sizeof(header));
+        std::stringstream corrupted(bytes);
+        REQUIRE_THROWS_AS(BinaryTree::load(corrupted), std::runtime_error);
+    }
+
+    SECTION("oversized") {
+        // a consistent header of 2^32 elements, whose storage must not be allocated before the stream runs out
+        auto bytes = stream.str();
+        csstree_internal::FileHeader header;
+        std::memcpy(&header, bytes.data(), sizeof(header));
+        const size_t slots = 8;
+        const size_t leaf_nodes = (size_t(1) << 32) / slots;
+        auto height = csstree_internal::ceil_log(slots + 1, leaf_nodes);
+        auto expp = csstree_internal::int_pow(slots + 1, height);
+        header.n_elements = uint64_t(1) << 32;
+        header.tree_height = height;
+        header.half_marker = (expp - 1) / slots;
+        header.n_internal_nodes = header.half_marker - (expp - leaf_nodes) / slots;
+        std::memcpy(&bytes[0], &header, sizeof(header));
+
+        std::stringstream oversized(bytes);
+        REQUIRE_THROWS_WITH(Tree::load(oversized), "Truncated CSSTree file");
+        UnseekableBuffer buffer(bytes);
+        std::istream unseekable(&buffer);
+        REQUIRE_THROWS_WITH(Tree::load(unseekable), "Truncated CSSTree file");
+
+        auto saved = stream.str();
+        UnseekableBuffer saved_buffer(saved);
+        std::istream saved_unseekable(&saved_buffer);
+        auto reloaded = Tree::load(saved_unseekable);
+        REQUIRE(reloaded.size() == data.size());
+        REQUIRE(std::equal(reloaded.begin(), reloaded.end(), data.cbegin()));
+    }
+
+#ifdef CSSTREE_MMAP
+    SECTION("map") {
+        const char *path = "csstree_test.bin";
+        {
+            std::ofstream out(path, std::ios::binary);
+            css.save(out);
+        }
+        auto mapped = Tree::map(path);
+        std::remove(path);
+        REQUIRE(mapped.size() == css.size());
+        REQUIRE(std::equal(mapped.begin(), mapped.end(), data.cbegin()));
+        for (int64_t key = -1; key < 100001; key += 7)
+            REQUIRE(mapped.find(key) - mapped.begin() == css.find(key) - css.begin());
+        REQUIRE_THROWS_AS(Tree::map(path), std::runtime_error);
+
+        std::stringstream saved;
+        css.save(saved);
+        auto bytes = saved.str();
+        csstree_internal::FileHeader header;
+        std::memcpy(&header, bytes.data(), sizeof(header));
+        header.n_elements = bytes.size();
+        std::memcpy(&bytes[0], &header, sizeof(header));
+        {
+            std::ofstream out(path, std::ios::binary);
+            out << bytes;
+        }
+        REQUIRE_THROWS_AS(Tree::map(path), std::runtime_error);
+        std::remove(path);
+    }
+#endif
+}
+
+TEST_CASE("merge") {
+    auto random_sorted = [](size_t n, int range) {
+        std::vector<int32_t> v(n);
+        std::generate(v.begin(), v.end(), [range] { return std::rand() % range; });
+        std::sort(v.begin(), v.end());
+        return v;
+    };
+
+    for (size_t n : {0, 5, 1000, 50000}) {
+        auto data = random_sorted(n, 10000);
+        auto inserted = random_sorted(n / 3 + 7, 10000);
+        auto erased = random_sorted(n / 4 + 3, 10000);
+        CSSTree<64, int32_t> css(data);
+        auto merged = CSSTree<64, int32_t>::merge(css, inserted, erased);
+
+        std::vector<int32_t> kept, expected;
+        std::set_difference(data.begin(), data.end(), erased.begin(), erased.end(), std::back_inserter(kept));
+        std::merge(kept.begin(), kept.end(), inserted.begin(), inserted.end(), std::back_inserter(expected));
+        REQUIRE(merged.size() == expected.size());
+        REQUIRE(std::equal(merged.begin(), merged.end(), expected.cbegin()));
+        REQUIRE(merged.height() == CSSTree<64, int32_t>(expected).height());
+        for (int32_t key = -1; key <= 10000; key += 3)
+            REQUIRE(merged.lower_bound(key) - merged.begin()
+                        == std::lower_bound(expected.cbegin(), expected.cend(), key) - expected.cbegin());
+    }
+
+    using Tree = CSSTree<64, int32_t>;
+    Tree css({1, 2, 3});
+    REQUIRE_THROWS_AS(Tree::merge(css, {2, 1}), std::invalid_argument);
+}
+
+TEST_CASE("parallel construction") {
+    std::vector<uint32_t> data(3000000);
+    std::generate(data.begin(), data.end(), std::rand);
+    std::sort(data.begin(), data.end());
+
+    CSSTree<16, uint32_t> serial(data);
+    CSSTree<16, uint32_t> parallel(data, 4);
+    std::stringstream serial_bytes, parallel_bytes;
+    serial.save(serial_bytes);
+    parallel.save(parallel_bytes);
+    REQUIRE(serial_bytes.str() == parallel_bytes.str());
+
+    auto all_threads = CSSTree<16, uint32_t>::view(data.data(), data.size(), 0);
+    REQUIRE(*all_threads.find(data[12345]) == data[12345]);
+
+    using Tree = CSSTree<16, uint32_t>;
+    std::swap(data[data.size() / 2], data[data.size() / 2 + 1]);
+    REQUIRE_THROWS_AS(Tree(data, 4), std::invalid_argument);
+}
+
+struct ThrowingLess {
+    static constexpr uint32_t poisoned = 2500000;
+
+    bool operator()(uint32_t a, uint32_t b) const {
+        if (a == poisoned || b == poisoned)
+            throw std::runtime_error("Comparison failed");
+        return a < b;
+    }
+};
+
+TEST_CASE("parallel construction failure") {
+    std::vector<uint32_t> data(3000000);
+    std::iota(data.begin(), data.end(), 0);
+
+    // the poisoned key is compared by a worker thread, whose exception must reach the caller
+    using Tree = CSSTree<16, uint32_t, std::allocator<uint32_t>, CSSFullLayout, ThrowingLess>;
+    REQUIRE_THROWS_AS(Tree(data, 1), std::runtime_error);
+    REQUIRE_THROWS_AS(Tree(data, 4), std::runtime_error);
+    REQUIRE_THROWS_AS(Tree::view(data.data(), data.size(), 0), std::runtime_error);
+}
+
+TEST_CASE("map") {
+    std::vector<int32_t> keys = {-3, 2, 4, 4, 11, 35, 60};
+    std::vector<std::string> values = {"a", "b", "c", "d", "e", "f", "g"};
+    CSSMap<8, int32_t, std::string> map(keys, values);
+    REQUIRE(map.size() == keys.size());
+
+    auto it = map.find(11);
+    REQUIRE(it.key() == 11);
+    REQUIRE(it.value() == "e");
+    REQUIRE((*it).second == "e");
+    REQUIRE(map.find(5) == map.end());
+    REQUIRE(*map.get(60) == "g");
+    REQUIRE(map.get(61) == nullptr);
+    REQUIRE(map.lower_bound(4).value() == "c");
+    REQUIRE(map.upper_bound(4).value() == "e");
+    REQUIRE(map.equal_range(4).second - map.equal_range(4).first == 2);
+
+    std::vector<std::string> visited;
+    for (auto kv : map)
+        visited.push_back(kv.second);
+    REQUIRE(visited == values);
+
+    using Map = CSSMap<8, int32_t, std::string>;
+
+    // the iterators support all the operations of random access iterators
+    auto first = map.begin();
+    REQUIRE(first->first == -3);
+    REQUIRE((2 + first)->second == "c");
+    REQUIRE(first[6].second == "g");
+    REQUIRE((first < it && it > first && first <= first && it >= first));
+    REQUIRE(std::distance(first, map.end()) == 7);
+    REQUIRE(std::next(first, 4) == it);
+    using reference = Map::const_iterator::reference;
+    auto greater = std::upper_bound(first, map.end(), 4, [](int32_t key, reference kv) { return key < kv.first; });
+    REQUIRE(greater - first == 4);
+
+    REQUIRE_THROWS_AS(Map(keys, {"a"}), std::invalid_argument);
+}
+
+TEST_CASE("floating-point keys") {
+    auto nan = std::numeric_limits<double>::quiet_NaN();
+    auto inf = std::numeric_limits<double>::infinity();
+    std::vector<double> data = {nan, -nan, 1.5, -0.0, 0.0, -inf, inf, -2.25, 1e-310, -1e-310, 3.0, 0.0};
+    for (int i = 0; i < 5000; ++i)
+        data.push_back((std::rand() % 20001 - 10000) / 8.0);
+    std::sort(data.begin(), data.end(), CSSFloatTree<64>::less);
+    CSSFloatTree<64> css(data);
+
+    for (double key : {-inf, -10000.0, -2.25, -1e-310, -0.0, 0.0, 1e-310, 0.125, 1.5, 3.0, 1250.0, inf, nan}) {
+        auto lb = std::lower_bound(data.cbegin(), data.cend(), key, CSSFloatTree<64>::less) - data.cbegin();
+        auto ub = std::upper_bound(data.cbegin(), data.cend(), key, CSSFloatTree<64>::less) - data.cbegin();
+        REQUIRE(css.lower_bound(key) - css.begin() == lb);
+        REQUIRE(css.upper_bound(key) - css.begin() == ub);
+        REQUIRE(css.count(key) == size_t(ub - lb));
+    }
+    REQUIRE(css.count(nan) == 2);
+    REQUIRE(css.count(0.0) == css.count(-0.0));
+    REQUIRE(*css.find(-0.0) == 0.0);
+    REQUIRE(css.find(0.1) == css.end());
+
+    std::vector<float> floats = {-1.f, 0.f, 2.f, std::numeric_limits<float>::quiet_NaN()};
+    auto small = CSSFloatTree<16, float>::view(floats.data(), floats.size());
+    REQUIRE(small.find(2.f) - small.begin() == 2);
+    std::swap(floats[0], floats[3]);
+    using FloatTree = CSSFloatTree<16, float>;
+    REQUIRE_THROWS_AS(FloatTree(floats), std::invalid_argument);
+}
+
+TEST_CASE("string keys") {
+    std::vector<std::string> data;
+    std::mt19937 gen(7);
+    for (int i = 0; i < 5000; ++i) {
+        std::string s = "https://example.com/";
+        auto length = gen() % 12;
+        for (size_t j = 0; j < length; ++j)
+            s += char('a' + gen() % 3);
+        if (i % 10 == 0)
+            s += std::string(1, '\0') + "x";
+        data.push_back(s);
+    }
+    data.push_back("https://example.com/\xff");
+    std::sort(data.begin(), data.end());
+    CSSStringTree<64> css(data);
+    REQUIRE(css.size() == data.size());
+
+    std::vector<std::string> keys = data;
+    keys.push_back("");
+    keys.push_back("a");
+    keys.push_back("https://");
+    keys.push_back("https://example.com");
+    keys.push_back("https://example.com/");
+    keys.push_back("https://example.com/\xff\xff");
+    keys.push_back("z");
+    for (int i = 0; i < 2000; ++i)
+        keys.push_back(data[gen() % data.size()] + char('a' + gen() % 4));
+    for (auto &key : keys) {
+        auto lb = std::lower_bound(data.cbegin(), data.cend(), key) - data.cbegin();
+        auto ub = std::upper_bound(data.cbegin(), data.cend(), key) - data.cbegin();
+        REQUIRE(css.lower_bound(key) - css.begin() == lb);
+        REQUIRE(css.upper_bound(key) - css.begin() == ub);
+        REQUIRE((css.find(key) != css.end()) == (lb != ub));
+    }
+
+    REQUIRE_THROWS_AS(CSSStringTree<64>({"b", "a"}), std::invalid_argument);
+}
+
+TEST_CASE("dynamic") {
+    std::vector<int64_t> data(20000);
+    std::generate(data.begin(), data.end(), [] { return std::rand() % 100000; });
+    std::sort(data.begin(), data.end());
+    data.erase(std::unique(data.begin(), data.end()), data.end());
+    std::set<int64_t> expected(data.begin(), data.end());
+    CSSDynamicTree<64, int64_t> css(data, 500);
+
+    for (int i = 0; i < 20000; ++i) {
+        int64_t key = std::rand() % 100000;
+        if (std::rand() % 2)
+            REQUIRE(css.insert(key) == expected.insert(key).second);
+        else
+            REQUIRE(css.erase(key) == (expected.erase(key) == 1));
+        REQUIRE(css.size() == expected.size());
+
+        int64_t query = std::rand() % 100010;
+        auto it = expected.lower_bound(query);
+        auto lb = css.lower_bound(query);
+        REQUIRE((lb == nullptr) == (it == expected.end()));
+        if (lb)
+            REQUIRE(*lb == *it);
+        REQUIRE((css.find(query) != nullptr) == (expected.count(query) == 1));
+        if (i == 10000)
+            css.flush();
+    }
+
+    css.flush();
+    REQUIRE(css.pending_updates() == 0);
+    for (int64_t key = -1; key < 100010; key += 3)
+        REQUIRE((css.find(key) != nullptr) == (expected.count(key) == 1));
+
+    using Tree = CSSDynamicTree<64, int64_t>;
+    REQUIRE_THROWS_AS(Tree({1, 1}), std::invalid_argument);
+}
+
+std::atomic<bool> fragile_copies(false);
+const std::thread::id main_thread_id = std::this_thread::get_id();
+
+/* A key whose copies throw on threads other than the main one while fragile_copies is set. */
+struct FragileKey {
+    int64_t value;
+
+    FragileKey(int64_t value = 0) : value(value) {}
+    FragileKey(const FragileKey &other) : value(other.value) { check(); }
+    FragileKey &operator=(const FragileKey &other) {
+        check();
+        value = other.value;
+        return *this;
+    }
+    bool operator<(const FragileKey &other) const { return value < other.value; }
+
+    static void check() {
+        if (fragile_copies && std::this_thread::get_id() != main_thread_id)
+            throw std::runtime_error("Copy failed");
+    }
+};
+
+TEST_CASE("dynamic rebuild failure") {
+    std::vector<FragileKey> data;
+    for (int64_t key = 0; key < 10; key += 2)
+        data.push_back(key);
+    CSSDynamicTree<64, FragileKey> css(data, 2);
+
+    // the third update freezes the first two, whose merge fails in the background
+    fragile_copies = true;
+    REQUIRE(css.insert(1));
+    REQUIRE(css.insert(3));
+    REQUIRE(css.erase(4));
+    REQUIRE_THROWS_AS(css.flush(), std::runtime_error);
+    REQUIRE(css.size() == 6);
+    REQUIRE(css.pending_updates() == 3);
+    for (int64_t key = 0; key < 10; ++key)
+        REQUIRE((css.find(key) != nullptr) == (key % 2 == 0 ? key != 4 : key < 4));
+
+    // the next update retries the merge of the frozen updates, and the flush merges the rest
+    fragile_copies = false;
+    REQUIRE(css.insert(5));
+    css.flush();
+    REQUIRE(css.pending_updates() == 0);
+    REQUIRE(css.size() == 7);
+    for (int64_t key = 0; key < 10; ++key)
+        REQUIRE((css.find(key) != nullptr) == (key % 2 == 0 ? key != 4 : key < 6));
+}
+
+TEST_CASE("handle") {
+    auto make_tree = [](int64_t version) {
+        std::vector<int64_t> data(1000);
+        std::iota(data.begin(), data.end(), version * 1000);
+        return CSSTree<64, int64_t>(std::move(data));
+    };
+
+    CSSTreeHandle<CSSTree<64, int64_t>> handle(make_tree(0));
+    std::atomic<bool> done(false);
+    std::atomic<size_t> errors(0);
+    std::vector<std::thread> readers;
+    for (int t = 0; t < 4; ++t) {
+        readers.emplace_back([&] {
+            CSSTreeHandle<CSSTree<64, int64_t>>::Reader reader(handle);
+            int64_t last_version = 0;
+            while (!done) {
+                auto tree = reader.pin();
+                auto version = *tree->begin() / 1000;
+                if (version < last_version || tree->size() != 1000 || *tree->find(version * 1000 + 999) % 1000 != 999)
+                    ++errors;
+                last_version = version;
+            }
+        });
+    }
+
+    for (int64_t version = 1; version <= 200; ++version) {
+        handle.publish(make_tree(version));
+        std::this_thread::yield();
+    }
+    done = true;
+    for (auto &t : readers)
+        t.join();
+    REQUIRE(errors == 0);
+    REQUIRE(handle.reclaim_unused() == 0);
+
+    CSSTreeHandle<CSSTree<64, int64_t>>::Reader reader(handle);
+    REQUIRE(*reader.pin()->begin() == 200000);
+}
+
+TEST_CASE("aligned allocation") {
+    csstree_internal::AlignedAllocator<int32_t, 64, std::allocator<int32_t>> aligned;
+    for (size_t n = 1; n < 100; n += 7) {
+        auto p = aligned.allocate(n);
+        REQUIRE(reinterpret_cast<uintptr_t>(p) % 64 == 0);
+        std::fill(p, p + n, 42);
+        aligned.deallocate(p, n);
+    }
+
+    CSSHugePageAllocator<int64_t> huge;
+    auto n = size_t(5) << 20;
+    auto p = huge.allocate(n);
+#if defined(CSSTREE_MMAP) && defined(MADV_HUGEPAGE)
+    REQUIRE(reinterpret_cast<uintptr_t>(p) % (2 << 20) == 0);
+#else
+    REQUIRE(reinterpret_cast<uintptr_t>(p) % alignof(int64_t) == 0);
+#endif
+    std::fill(p, p + n, 42);
+    huge.deallocate(p, n);
+
+    std::vector<int64_t> data(1000000);
+    for (size_t i = 0; i < data.size(); ++i)
+        data[i] = int64_t(i * 3);
+    CSSTree<16, int64_t, CSSHugePageAllocator<int64_t>> css(data);
+    REQUIRE(css.size_in_bytes() > (size_t(2) << 20));
+    for (size_t i = 0; i < data.size(); i += 11)
+        REQUIRE(*css.find(data[i]) == data[i]);
+    REQUIRE(css.find(1) == css.end());
+}
+
+template<typename T>
+struct CountingAllocator {
+    using value_type = T;
+    size_t *allocated;
+
+    explicit CountingAllocator(size_t *allocated) : allocated(allocated) {}
+
+    template<typename U>
+    CountingAllocator(const CountingAllocator<U> &other) : allocated(other.allocated) {}
+
+    T *allocate(size_t n) {
+        *allocated += n * sizeof(T);
+        return std::allocator<T>().allocate(n);
+    }
+
+    void deallocate(T *p, size_t n) {
+        *allocated -= n * sizeof(T);
+        std::allocator<T>().deallocate(p, n);
+    }
+
+    template<typename U>
+    bool operator==(const CountingAllocator<U> &other) const { return allocated == other.allocated; }
+
+    template<typename U>
+    bool operator!=(const CountingAllocator<U> &other) const { return allocated != other.allocated; }
+};
+
+TEST_CASE("custom allocator") {
+    using Allocator = CountingAllocator<int32_t>;
+    std::vector<int32_t> data(10000);
+    for (size_t i = 0; i < data.size(); ++i)
+        data[i] = int32_t(i);
+
+    size_t allocated = 0;
+    {
+        CSSTree<64, int32_t, Allocator> css(data, 1, Allocator(&allocated));
+        REQUIRE(allocated >= css.size_in_bytes() + data.size() * sizeof(int32_t));
+        REQUIRE(*css.find(1234) == 1234);
+
+        auto copy = css;
+        REQUIRE(*copy.find(4321) == 4321);
+
+        std::vector<int32_t, Allocator> owned(data.begin(), data.end(), Allocator(&allocated));
+        CSSTree<64, int32_t, Allocator> moved(std::move(owned));
+        REQUIRE(*moved.find(42) == 42);
+
+        auto view = CSSTree<64, int32_t, Allocator>::view(data.data(), data.size(), 1, Allocator(&allocated));
+        REQUIRE(*view.find(4321) == 4321);
+    }
+    REQUIRE(allocated == 0);
+}
+
+/* Allocates from a fixed buffer, aligning each allocation only as much as its type needs. */
+template<typename T>
+struct ArenaAllocator {
+    using value_type = T;
+    std::vector<char> *buffer;
+    size_t *used;
+
+    ArenaAllocator(std::vector<char> *buffer, size_t *used) : buffer(buffer), used(used) {}
+
+    template<typename U>
+    ArenaAllocator(const ArenaAllocator<U> &other) : buffer(other.buffer), used(other.used) {}
+
+    T *allocate(size_t n) {
+        auto offset = csstree_internal::align_up(*used, alignof(T));
+        if (offset + n * sizeof(T) > buffer->size())
+            throw std::bad_alloc();
+        *used = offset + n * sizeof(T);
+        return reinterpret_cast<T *>(buffer->data() + offset);
+    }
+
+    void deallocate(T *, size_t) {}
+
+    template<typename U>
+    bool operator==(const ArenaAllocator<U> &other) const { return buffer == other.buffer; }
+
+    template<typename U>
+    bool operator!=(const ArenaAllocator<U> &other) const { return buffer != other.buffer; }
+};
+
+TEST_CASE("arena allocator") {
+    std::vector<int32_t> data(1007);
+    for (size_t i = 0; i < data.size(); ++i)
+        data[i] = int32_t(2 * i);
+
+    // an earlier allocation of each size leaves the next one at every offset from a cache line
+    for (size_t padding = 0; padding <= 64; ++padding) {
+        std::vector<char> buffer(1 << 16);
+        size_t used = padding;
+        ArenaAllocator<int32_t> allocator(&buffer, &used);
+        CSSTree<64, int32_t, ArenaAllocator<int32_t>> css(data, 1, allocator);
+        for (auto key : data)
+            REQUIRE(*css.find(key) == key);
+        REQUIRE(css.find(1) == css.end());
+    }
+
+#ifdef CSSTREE_PMR
+    for (size_t padding = 1; padding <= 64; ++padding) {
+        std::pmr::monotonic_buffer_resource resource;
+        (void) resource.allocate(padding, 1);
+        CSSPmrTree<64, int32_t> css(data, 1, std::pmr::polymorphic_allocator<int32_t>(&resource));
+        for (auto key : data)
+            REQUIRE(*css.find(key) == key);
+        REQUIRE(css.find(2012) - css.begin() == 1006);
+    }
+
+    // a copy takes the default resource for all its storage, so it outlives the resource of the source
+    std::unique_ptr<CSSPmrTree<64, int32_t>> copy;
+    {
+        std::pmr::monotonic_buffer_resource resource;
+        CSSPmrTree<64, int32_t> css(data, 1, std::pmr::polymorphic_allocator<int32_t>(&resource));
+        copy.reset(new CSSPmrTree<64, int32_t>(css));
+    }
+    for (auto key : data)
+        REQUIRE(*copy->find(key) == key);
+    REQUIRE(copy->find(1) == copy->end());
+#endif
+}